@@ -0,0 +1,122 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "append.h"
+#include "delta.h"
+#include "filestate.h"
+
+// Append-aware replication. After each write we remember the target's
+// size, inode and mtime. When the source later grows, and the target is
+// still as we left it, only the new tail is copied; when it shrinks, the
+// target is truncated. Anything else is left to the caller, which falls
+// back to a delta or a full copy.
+//
+// That the source only grew or shrank is checked on a few samples: its
+// head, the end of what is kept, and a spot that moves along the file
+// with every check. The whole kept part is compared (delta_verify) only
+// once it has doubled since it last was, so a growing log costs reads in
+// proportion to what it grows by, not to its size at every event.
+
+#define SAMPLE 4096     // bytes compared at each sampled offset
+
+static ssize_t read_at(int fd, unsigned char *buf, size_t len, off_t off) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = pread(fd, buf + got, len - got, off + got);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        got += r;
+    }
+    return (ssize_t)got;
+}
+
+// Whether in and out agree on the samples of their first len bytes.
+static int probe(FileState *fs, int in, int out, off_t len) {
+    unsigned char a[SAMPLE], b[SAMPLE];
+    off_t at[3] = {0, len - SAMPLE, fs->probe};
+
+    fs->probe += DELTA_BLOCK;
+    if (fs->probe >= len)
+        fs->probe = 0;
+    for (int i = 0; i < 3; i++) {
+        off_t off = at[i] < 0 ? 0 : at[i];
+        if (off >= len)
+            continue;
+        size_t n = len - off < SAMPLE ? len - off : SAMPLE;
+        if (read_at(in, a, n, off) != (ssize_t)n ||
+            read_at(out, b, n, off) != (ssize_t)n || memcmp(a, b, n))
+            return 0;
+    }
+    return 1;
+}
+
+int append_sync(const char *src, const char *dst, CopyResult *res) {
+    FileState *fs = filestate_get(dst, 0);
+    if (!fs)
+        return -1;
+
+    int rc = -1, out = -1;
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0 || (out = open_target(dst, O_RDWR | O_CLOEXEC, 0)) < 0)
+        goto done;
+
+    struct stat ss, ds;
+    if (fstat(in, &ss) < 0 || fstat(out, &ds) < 0 ||
+        !filestate_matches(fs, &ds) || ss.st_size == ds.st_size)
+        goto done;
+
+    off_t keep = ss.st_size < ds.st_size ? ss.st_size : ds.st_size;
+    if (!probe(fs, in, out, keep))
+        goto done;
+    if (keep / 2 >= fs->checked) {
+        if (!delta_verify(fs, in, out, keep))
+            goto done;
+        fs->checked = keep;
+    }
+    if (ss.st_size > ds.st_size)
+        rc = copy_range(in, out, ds.st_size, ss.st_size - ds.st_size, res);
+    else
+        rc = ftruncate(out, ss.st_size);
+
+    if (rc == 0) {
+        copy_metadata(in, out, &ss);
+        if (fs->has_sums)
+            delta_track(fs, out, keep);
+        else
+            filestate_record(fs, out);
+    } else {
+        fs->size = -1;
+    }
+
+done:
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    filestate_put(fs);
+    return rc;
+}
+
+// Remembers a target that was just written whole from its source. Only
+// its metadata is taken; nothing is read back.
+void append_track(const char *dst) {
+    FileState *fs = filestate_get(dst, 1);
+    if (!fs) return;
+
+    int fd = open(dst, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fs->size = -1;
+    } else {
+        filestate_record(fs, fd);
+        fs->checked = fs->size;
+        close(fd);
+    }
+    filestate_put(fs);
+}
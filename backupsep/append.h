@@ -0,0 +1,9 @@
+#ifndef APPEND_H
+#define APPEND_H
+
+#include "copy.h"
+
+int append_sync(const char *src, const char *dst, CopyResult *res);
+void append_track(const char *dst);
+
+#endif
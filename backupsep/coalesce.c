@@ -0,0 +1,217 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "coalesce.h"
+#include "utils.h"
+
+// Pending paths are hashed by source path and kept on one list, which
+// coalesce_run scans only once the earliest deadline it knows of has
+// passed. A path is applied once it has had no events for quiet_ms, or
+// once it has been pending for HOLD_FACTOR quiet windows if it never
+// settles, and never sooner than interval_ms after it was last applied.
+// Applied paths linger, idle, until that interval is over so the next
+// event on them still honours it.
+
+#define COALESCE_BUCKETS 4096
+#define HOLD_FACTOR 10
+
+typedef struct Pending {
+    struct Pending *hnext;          // bucket chain
+    struct Pending *prev, *next;    // all pending paths
+    char *path;
+    uint32_t first;                 // mask of the first event merged
+    uint32_t mask;                  // all events merged, 0 = idle
+    long long since, last;          // first and latest event, ms
+    long long applied;              // last applied, ms, or -1
+} Pending;
+
+static Pending *buckets[COALESCE_BUCKETS];
+static Pending *head;
+static int quiet, interval, hold;
+static long long next_due = -1;     // no entry is due before this
+
+static unsigned bucket(const char *s) {
+    unsigned h = 5381;
+    while (*s)
+        h = h * 33 + (unsigned char)*s++;
+    return h % COALESCE_BUCKETS;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void coalesce_init(int quiet_ms, int interval_ms) {
+    quiet = quiet_ms;
+    interval = interval_ms;
+    hold = HOLD_FACTOR * quiet > interval ? HOLD_FACTOR * quiet : interval;
+}
+
+static Pending **find(const char *path) {
+    Pending **pp = &buckets[bucket(path)];
+    while (*pp && strcmp((*pp)->path, path))
+        pp = &(*pp)->hnext;
+    return pp;
+}
+
+static void hash_in(Pending *p) {
+    unsigned b = bucket(p->path);
+    p->hnext = buckets[b];
+    buckets[b] = p;
+}
+
+static void drop(Pending *p) {
+    Pending **pp = find(p->path);
+    *pp = p->hnext;
+    if (p->prev) p->prev->next = p->next; else head = p->next;
+    if (p->next) p->next->prev = p->prev;
+    free(p->path);
+    free(p);
+}
+
+static long long due(const Pending *p) {
+    if (!p->mask)
+        return p->applied + interval;
+    long long d = p->last + quiet;
+    if (d > p->since + hold)
+        d = p->since + hold;
+    if (p->applied >= 0 && d < p->applied + interval)
+        d = p->applied + interval;
+    return d;
+}
+
+static void note_due(long long d) {
+    if (next_due < 0 || d < next_due)
+        next_due = d;
+}
+
+// Merges an event into the path's pending entry. Returns 1 if one was
+// already pending, so this event will not be applied on its own.
+int coalesce_add(const char *path, uint32_t mask) {
+    long long now = now_ms();
+    Pending *p = *find(path);
+    int merged = p && p->mask;
+    if (!p) {
+        if (!(p = calloc(1, sizeof(*p))) || !(p->path = strdup(path))) {
+            free(p);
+            return 0;
+        }
+        p->applied = -1;
+        hash_in(p);
+        p->next = head;
+        if (head) head->prev = p;
+        head = p;
+    }
+    if (!p->mask) {
+        p->first = mask;
+        p->since = now;
+    }
+    p->mask |= mask;
+    p->last = now;
+    note_due(due(p));
+    return merged;
+}
+
+// Follows a rename: what was pending at from (and below it, for a
+// directory) is now pending under to, replacing anything there.
+void coalesce_move(const char *from, const char *to, int tree) {
+    char path[PATH_MAX];
+    Pending *p = *find(to);
+    if (p)
+        drop(p);
+    for (p = head; p; p = p->next) {
+        if (tree ? !is_subpath(from, p->path) : strcmp(p->path, from) != 0)
+            continue;
+        int n = snprintf(path, sizeof(path), "%s%s", to,
+                         p->path + strlen(from));
+        char *moved = n < 0 || n >= (int)sizeof(path) ? NULL : strdup(path);
+        if (!moved)
+            continue;
+        Pending **pp = find(p->path);
+        *pp = p->hnext;
+        free(p->path);
+        p->path = moved;
+        hash_in(p);
+    }
+}
+
+// Hands fn what the merged events add up to, judged by what is at path
+// now. Something that appeared and went again within the window needs
+// nothing; something deleted and recreated is replaced.
+static void apply(const char *path, uint32_t first, uint32_t mask,
+                  CoalesceFn fn, void *arg) {
+    struct stat st;
+    if (lstat(path, &st) < 0) {
+        if (errno == ENOENT && !(first & IN_CREATE))
+            fn(path, IN_DELETE, arg);
+        return;
+    }
+    if (mask & IN_DELETE) {
+        fn(path, IN_DELETE, arg);
+        mask = (mask & ~IN_DELETE) | IN_CREATE;
+    }
+    fn(path, mask, arg);
+}
+
+// Applies every path that is due. Returns the ms until the next one is,
+// or -1 if nothing is pending.
+long long coalesce_run(CoalesceFn fn, void *arg) {
+    long long now = now_ms();
+    if (next_due < 0 || now < next_due)
+        return next_due < 0 ? -1 : next_due - now;
+
+    next_due = -1;
+    Pending *p = head;
+    while (p) {
+        Pending *next = p->next;
+        long long d = due(p);
+        if (d > now) {
+            note_due(d);
+        } else if (!p->mask) {
+            drop(p);
+        } else {
+            uint32_t first = p->first, mask = p->mask;
+            p->first = p->mask = 0;
+            p->applied = now;
+            apply(p->path, first, mask, fn, arg);
+            if (interval > 0)
+                note_due(due(p));
+            else
+                drop(p);
+        }
+        p = next;
+    }
+    if (next_due < 0)
+        return -1;
+    now = now_ms();
+    return next_due > now ? next_due - now : 0;
+}
+
+// Applies what is pending at path now, ahead of an event that depends on
+// it, such as a directory created where a file was deleted.
+void coalesce_settle(const char *path, CoalesceFn fn, void *arg) {
+    Pending *p = *find(path);
+    if (!p || !p->mask)
+        return;
+    uint32_t first = p->first, mask = p->mask;
+    drop(p);
+    apply(path, first, mask, fn, arg);
+}
+
+// Applies everything still pending, due or not, and forgets it all.
+void coalesce_flush(CoalesceFn fn, void *arg) {
+    while (head) {
+        Pending *p = head;
+        if (p->mask)
+            apply(p->path, p->first, p->mask, fn, arg);
+        drop(p);
+    }
+    next_due = -1;
+}
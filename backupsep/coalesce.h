@@ -0,0 +1,18 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stdint.h>
+
+// Per-path debouncing of file events. Events on a path are merged until
+// it has been quiet for a while, then applied as their net effect; a
+// path is also applied at most once per interval.
+typedef void (*CoalesceFn)(const char *path, uint32_t mask, void *arg);
+
+void coalesce_init(int quiet_ms, int interval_ms);
+int coalesce_add(const char *path, uint32_t mask);
+void coalesce_settle(const char *path, CoalesceFn fn, void *arg);
+void coalesce_move(const char *from, const char *to, int tree);
+long long coalesce_run(CoalesceFn fn, void *arg);
+void coalesce_flush(CoalesceFn fn, void *arg);
+
+#endif
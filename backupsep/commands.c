@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 #include <signal.h>
 #include <limits.h>
 #include <errno.h>
@@ -13,6 +14,7 @@
 #include "commands.h"
 #include "worker.h"
 #include "utils.h"
+#include "manifest.h"
 
 #define MAX_BACKUPS 32
 
@@ -20,6 +22,8 @@ typedef struct {
     char source[PATH_MAX];
     char target[PATH_MAX];
     pid_t pid;
+    BackupOptions opt;
+    WorkerStats *stats;     // shared with the worker, NULL if unmapped
 } BackupTarget;
 
 static BackupTarget backups[MAX_BACKUPS];
@@ -38,7 +42,7 @@ int backup_exists(const char *src, const char *dst) {
     return 0;
 }
 
-void cmd_add(char *src, char *dst) {
+void cmd_add(char *src, char *dst, const BackupOptions *opt) {
     if (backup_count >= MAX_BACKUPS) {
         printf("Too many backups\n");
         return;
@@ -47,6 +51,11 @@ void cmd_add(char *src, char *dst) {
     char rs[PATH_MAX], rt[PATH_MAX];
 
     if (!real_path(src, rs)) return;
+
+    // Nothing is created until the pair is known to be valid.
+    int exists = access(dst, F_OK) == 0;
+    if (!(exists ? real_path(dst, rt) : real_new_path(dst, rt))) return;
+
     if (is_subpath(rs, rt) || is_subpath(rt, rs)) {
         printf("Error: recursive backup not allowed\n");
         return;
@@ -57,30 +66,39 @@ void cmd_add(char *src, char *dst) {
         return;
     }
 
-    if (access(dst, F_OK) == 0) {
-        if (!dir_empty(dst)) {
+    if (exists) {
+        // A previous backup's target is resumed; its manifest says what
+        // is already there.
+        if (!dir_empty(rt) && !manifest_exists(rt)) {
             printf("Target not empty\n");
             return;
         }
-    } else {
-        mkdir(dst, 0755);
+    } else if (mkdir(rt, 0755) < 0) {
+        perror("mkdir");
+        return;
     }
 
-    if (!real_path(dst, rt)) return;
+    WorkerStats *stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED)
+        stats = NULL;
 
     pid_t pid = fork();
     if (pid < 0) {
         perror("fork");
+        if (stats) munmap(stats, sizeof(*stats));
         return;
     }
     if (pid == 0) {
-        run_worker(rs, rt);
+        run_worker(rs, rt, opt, exists, stats);
         exit(0);
     }
 
     strcpy(backups[backup_count].source, rs);
     strcpy(backups[backup_count].target, rt);
     backups[backup_count].pid = pid;
+    backups[backup_count].opt = *opt;
+    backups[backup_count].stats = stats;
     backup_count++;
 
     printf("Backup started\n");
@@ -90,9 +108,28 @@ void cmd_list(void) {
     for (int i = 0; i < backup_count; i++) {
         printf("Source: %s\n", backups[i].source);
         for (int j = i; j < backup_count; j++) {
-            if (!strcmp(backups[i].source, backups[j].source))
-                printf("  -> %s (pid %d)\n",
-                       backups[j].target, backups[j].pid);
+            if (strcmp(backups[i].source, backups[j].source))
+                continue;
+            printf("  -> %s (pid %d, sync %s)\n",
+                   backups[j].target, backups[j].pid,
+                   sync_policy_name(backups[j].opt.sync));
+            const WorkerStats *s = backups[j].stats;
+            if (!s)
+                continue;
+            printf("     %lu events (%lu coalesced), %lu lost, %lu resyncs "
+                   "(%lu dirs rescanned, %lu entries repaired)\n",
+                   __atomic_load_n(&s->events, __ATOMIC_RELAXED),
+                   __atomic_load_n(&s->coalesced, __ATOMIC_RELAXED),
+                   __atomic_load_n(&s->overflows, __ATOMIC_RELAXED),
+                   __atomic_load_n(&s->resyncs, __ATOMIC_RELAXED),
+                   __atomic_load_n(&s->rescanned, __ATOMIC_RELAXED),
+                   __atomic_load_n(&s->repaired, __ATOMIC_RELAXED));
+            printf("     %lu KB queued (peak %lu KB), "
+                   "lag %lu ms (max %lu ms)\n",
+                   __atomic_load_n(&s->queued, __ATOMIC_RELAXED) >> 10,
+                   __atomic_load_n(&s->queued_peak, __ATOMIC_RELAXED) >> 10,
+                   __atomic_load_n(&s->lag_ms, __ATOMIC_RELAXED),
+                   __atomic_load_n(&s->lag_max_ms, __ATOMIC_RELAXED));
         }
         while (i + 1 < backup_count &&
                !strcmp(backups[i].source, backups[i + 1].source))
@@ -110,6 +147,8 @@ void cmd_end(char *src, char *dst) {
 
             kill(backups[i].pid, SIGTERM);
             waitpid(backups[i].pid, NULL, 0);
+            if (backups[i].stats)
+                munmap(backups[i].stats, sizeof(WorkerStats));
 
             backups[i] = backups[backup_count - 1];
             backup_count--;
@@ -121,7 +160,7 @@ void cmd_end(char *src, char *dst) {
     printf("Backup not found\n");
 }
 
-void cmd_restore(const char *source, const char *target) {
+void cmd_restore(const char *source, const char *target, int paranoid) {
     char rs[PATH_MAX], rt[PATH_MAX];
 
     if (!real_path(source, rs) || !real_path(target, rt))
@@ -129,10 +168,32 @@ void cmd_restore(const char *source, const char *target) {
 
     printf("Restoring backup...\n");
 
-    restore_copy(rt, rs);
+    CopyResult res = {0, COPY_NONE};
+    long long examined = restore_copy(rt, rs, &res, paranoid);
     restore_cleanup(rs, rt);
 
-    printf("Restore complete\n");
+    printf("Restore complete: %lld bytes copied (%s)\n",
+           res.bytes, copy_method_name(res.method));
+    if (paranoid)
+        printf("Compared %lld bytes\n", examined);
+}
+
+void cmd_verify(const char *source, const char *target) {
+    char rs[PATH_MAX], rt[PATH_MAX];
+
+    if (!real_path(source, rs) || !real_path(target, rt))
+        return;
+
+    VerifyResult res;
+    memset(&res, 0, sizeof(res));
+    if (verify_backup(rs, rt, &res) < 0) {
+        printf("No manifest in %s\n", rt);
+        return;
+    }
+    printf("Verified %ld files: %ld ok, %ld stale, %ld changed, "
+           "%ld corrupt, %ld not hashed yet\n",
+           res.files, res.ok, res.stale, res.changed, res.corrupt,
+           res.unhashed);
 }
 
 void cleanup_backups(void) {
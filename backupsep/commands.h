@@ -2,12 +2,14 @@
 #define COMMANDS_H
 
 #include <wordexp.h>
+#include "options.h"
 
 int parse_command(const char *line, wordexp_t *p);
-void cmd_add(char *src, char *dst);
+void cmd_add(char *src, char *dst, const BackupOptions *opt);
 void cmd_list(void);
 void cmd_end(char *src, char *dst);
-void cmd_restore(const char *source, const char *target);
+void cmd_restore(const char *source, const char *target, int paranoid);
+void cmd_verify(const char *source, const char *target);
 void cleanup_backups(void);
 
 #endif
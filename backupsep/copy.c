@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include "copy.h"
+
+#define RW_BUF      (64 << 10)
+#define PREALLOC_MIN (1 << 20)
+#define HASH_BUF    (1 << 20)
+
+// Set once the running kernel reports ENOSYS, so we stop retrying.
+static int no_copy_range, no_sendfile, no_splice;
+static int copy_xattrs;
+static CopyYield yield_fn;
+static int cancelled;
+
+static int method_disabled(CopyMethod m) {
+    switch (m) {
+    case COPY_FILE_RANGE: return no_copy_range;
+    case COPY_SENDFILE:   return no_sendfile;
+    case COPY_SPLICE:     return no_splice;
+    default:              return 0;
+    }
+}
+
+static void disable_method(CopyMethod m) {
+    if (m == COPY_FILE_RANGE) no_copy_range = 1;
+    else if (m == COPY_SENDFILE) no_sendfile = 1;
+    else if (m == COPY_SPLICE) no_splice = 1;
+}
+
+static CopyMethod next_method(CopyMethod m) {
+    do {
+        m = m == COPY_READWRITE ? COPY_READWRITE : (CopyMethod)(m + 1);
+    } while (m != COPY_READWRITE && method_disabled(m));
+    return m;
+}
+
+// Errors that mean "this engine cannot handle this pair of fds".
+static int can_fall_back(int err) {
+    return err == ENOSYS || err == EXDEV || err == EINVAL ||
+           err == EOPNOTSUPP || err == EBADF;
+}
+
+static ssize_t do_copy_file_range(int in, int out, off_t off, size_t n) {
+    loff_t a = off, b = off;
+    return copy_file_range(in, &a, out, &b, n, 0);
+}
+
+static ssize_t do_sendfile(int in, int out, off_t off, size_t n) {
+    if (lseek(out, off, SEEK_SET) < 0)
+        return -1;
+    off_t o = off;
+    return sendfile(out, in, &o, n);
+}
+
+static ssize_t do_splice(int in, int out, off_t off, size_t n, int p[2]) {
+    if (p[0] < 0) {
+        if (pipe2(p, O_CLOEXEC) < 0)
+            return -1;
+        fcntl(p[1], F_SETPIPE_SZ, 1 << 20);
+    }
+
+    loff_t a = off, b = off;
+    ssize_t got = splice(in, &a, p[1], NULL, n, SPLICE_F_MOVE);
+    if (got <= 0) return got;
+
+    for (ssize_t left = got; left > 0; ) {
+        ssize_t w = splice(p[0], NULL, out, &b, left, SPLICE_F_MOVE);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            // Data is stranded in the pipe; drop it and redo the range.
+            int err = w < 0 ? errno : EIO;
+            close(p[0]);
+            close(p[1]);
+            p[0] = p[1] = -1;
+            errno = err;
+            return -1;
+        }
+        left -= w;
+    }
+    return got;
+}
+
+static ssize_t do_readwrite(int in, int out, off_t off, size_t n) {
+    char buf[RW_BUF];
+    if (n > sizeof(buf)) n = sizeof(buf);
+
+    ssize_t got = pread(in, buf, n, off);
+    if (got <= 0) return got;
+
+    for (ssize_t w = 0; w < got; ) {
+        ssize_t r = pwrite(out, buf + w, got - w, off + w);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        w += r;
+    }
+    return got;
+}
+
+int copy_range(int in, int out, off_t off, off_t len, CopyResult *res) {
+    CopyMethod m = method_disabled(COPY_FILE_RANGE)
+                 ? next_method(COPY_FILE_RANGE) : COPY_FILE_RANGE;
+    int p[2] = {-1, -1};
+    off_t done = 0;
+    int rc = 0;
+
+    while (done < len) {
+        size_t n = len - done > COPY_CHUNK ? COPY_CHUNK : (size_t)(len - done);
+        ssize_t r;
+        if (copy_cancelled()) {
+            errno = ECANCELED;
+            rc = -1;
+            break;
+        }
+
+        switch (m) {
+        case COPY_FILE_RANGE: r = do_copy_file_range(in, out, off + done, n); break;
+        case COPY_SENDFILE:   r = do_sendfile(in, out, off + done, n); break;
+        case COPY_SPLICE:     r = do_splice(in, out, off + done, n, p); break;
+        default:              r = do_readwrite(in, out, off + done, n); break;
+        }
+
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (m != COPY_READWRITE && can_fall_back(errno)) {
+                if (errno == ENOSYS)
+                    disable_method(m);
+                m = next_method(m);
+                continue;
+            }
+            rc = -1;
+            break;
+        }
+        if (r == 0)
+            break; // source shrank under us
+
+        done += r;
+        if (res) {
+            res->bytes += r;
+            res->method = m;
+        }
+        if (done < len)
+            copy_yield();
+    }
+
+    if (p[0] >= 0) {
+        close(p[0]);
+        close(p[1]);
+    }
+    return rc;
+}
+
+// Read/write copy that feeds every buffer it writes to the digest, so
+// the content is hashed in the same pass. Stops quietly at an early EOF;
+// the digest then comes up short and is discarded.
+static int hash_range(int in, int out, off_t off, off_t len,
+                      CopyResult *res, FileDigest *d, char *buf) {
+    off_t done = 0, chunk = 0;
+    while (done < len) {
+        if (copy_cancelled()) {
+            errno = ECANCELED;
+            return -1;
+        }
+        size_t n = len - done > HASH_BUF ? HASH_BUF : (size_t)(len - done);
+        ssize_t got = pread(in, buf, n, off + done);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) return -1;
+        if (got == 0) break;
+
+        file_digest_update(d, buf, got);
+        for (ssize_t w = 0; w < got; ) {
+            ssize_t r = pwrite(out, buf + w, got - w, off + done + w);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            w += r;
+        }
+        done += got;
+        if (res) {
+            res->bytes += got;
+            res->method = COPY_READWRITE;
+        }
+        if (done - chunk >= COPY_CHUNK && done < len) {
+            copy_yield();
+            chunk = done;
+        }
+    }
+    return 0;
+}
+
+static int move_range(int in, int out, off_t off, off_t len, CopyResult *res,
+                      FileDigest *d, char *buf) {
+    if (!buf)
+        return copy_range(in, out, off, len, res);
+    return hash_range(in, out, off, len, res, d, buf);
+}
+
+// Copies only the data segments of a sparse file and extends the target
+// to the full size, so holes stay holes. The digest sees them as zeros.
+static int copy_sparse(int in, int out, off_t size, CopyResult *res,
+                       FileDigest *d, char *buf) {
+    off_t data = 0, pos = 0;
+    while (data < size) {
+        data = lseek(in, data, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO)
+                break;  // only a hole is left
+            if (errno == EINVAL)
+                return move_range(in, out, 0, size, res, d, buf);
+            return -1;
+        }
+
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0 || hole > size)
+            hole = size;
+        if (buf)
+            file_digest_zeros(d, data - pos);
+        if (move_range(in, out, data, hole - data, res, d, buf) < 0)
+            return -1;
+        data = pos = hole;
+    }
+    if (buf && pos < size)
+        file_digest_zeros(d, size - pos);
+    return ftruncate(out, size);
+}
+
+// Copies all of in into the empty file out, along with its metadata.
+// Sparse sources keep their holes; large dense ones get their blocks
+// reserved up front. With a digest, the data goes through user space
+// once and is hashed on the way, in place of the in-kernel engines.
+static int copy_fd_digest(int in, int out, CopyResult *res, FileDigest *d) {
+    struct stat st;
+    if (fstat(in, &st) < 0)
+        return -1;
+
+    char *buf = NULL;
+    if (d && file_digest_init(d, d->algo, st.st_size) == 0 &&
+        !(buf = malloc(HASH_BUF)))
+        file_digest_free(d);
+
+    int rc;
+    if ((long long)st.st_blocks * 512 < (long long)st.st_size) {
+        rc = copy_sparse(in, out, st.st_size, res, d, buf);
+    } else {
+        // Best effort: KEEP_SIZE so a source that shrinks mid-copy does
+        // not leave a zero-filled tail behind.
+        if (st.st_size >= PREALLOC_MIN)
+            fallocate(out, FALLOC_FL_KEEP_SIZE, 0, st.st_size);
+        rc = move_range(in, out, 0, st.st_size, res, d, buf);
+    }
+    if (rc == 0)
+        copy_metadata(in, out, &st);
+    if (buf) {
+        if (rc < 0 || file_digest_final(d) < 0)
+            d->len = 0;
+        free(buf);
+    }
+    return rc;
+}
+
+int copy_fd(int in, int out, CopyResult *res) {
+    return copy_fd_digest(in, out, res, NULL);
+}
+
+// As copy_fd, also leaving the digest of what was written in *d (len 0
+// if none could be had). The caller frees *d either way.
+int copy_fd_hashed(int in, int out, CopyResult *res, HashAlgo algo,
+                   FileDigest *d) {
+    memset(d, 0, sizeof(*d));
+    d->algo = algo;
+    return copy_fd_digest(in, out, res, d);
+}
+
+void copy_set_xattrs(int on) {
+    copy_xattrs = on;
+}
+
+// Long copies call fn between chunks, so whoever runs them can get
+// other work done in the meantime.
+void copy_set_yield(CopyYield fn) {
+    yield_fn = fn;
+}
+
+void copy_yield(void) {
+    if (yield_fn)
+        yield_fn();
+}
+
+// Makes every copy in progress, and any started later, fail with
+// ECANCELED at its next chunk, so a stop does not wait for them.
+void copy_cancel(void) {
+    __atomic_store_n(&cancelled, 1, __ATOMIC_RELAXED);
+}
+
+int copy_cancelled(void) {
+    return __atomic_load_n(&cancelled, __ATOMIC_RELAXED);
+}
+
+static void copy_xattr_list(int in, int out) {
+    ssize_t len = flistxattr(in, NULL, 0);
+    if (len <= 0) return;
+
+    char *names = malloc(len);
+    if (!names) return;
+    len = flistxattr(in, names, len);
+
+    char *val = NULL;
+    size_t cap = 0;
+    for (char *name = names; len > 0 && name < names + len;
+         name += strlen(name) + 1) {
+        ssize_t n = fgetxattr(in, name, NULL, 0);
+        if (n < 0) continue;
+        if ((size_t)n > cap) {
+            char *v = realloc(val, n);
+            if (!v) break;
+            val = v;
+            cap = n;
+        }
+        n = fgetxattr(in, name, val, cap);
+        if (n >= 0)
+            fsetxattr(out, name, val, n, 0);   // EPERM/ENOTSUP are fine
+    }
+    free(val);
+    free(names);
+}
+
+// Gives out the mode and timestamps of in (st describes in), plus its
+// extended attributes when enabled. Timestamps go last so nothing
+// after them bumps the mtime.
+void copy_metadata(int in, int out, const struct stat *st) {
+    if (copy_xattrs)
+        copy_xattr_list(in, out);
+    fchmod(out, st->st_mode & 07777);
+
+    struct timespec times[2] = {st->st_atim, st->st_mtim};
+    futimens(out, times);
+}
+
+// The cheap "already replicated" test: both exist with the same size
+// and the same mtime, which the copier carries over.
+int same_size_mtime(const char *a, const char *b) {
+    struct statx sa, sb;
+    unsigned mask = STATX_TYPE | STATX_SIZE | STATX_MTIME;
+    int flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+
+    if (statx(AT_FDCWD, a, flags, mask, &sa) < 0 ||
+        statx(AT_FDCWD, b, flags, mask, &sb) < 0)
+        return 0;
+    return (sa.stx_mode & S_IFMT) == (sb.stx_mode & S_IFMT) &&
+           sa.stx_size == sb.stx_size &&
+           sa.stx_mtime.tv_sec == sb.stx_mtime.tv_sec &&
+           sa.stx_mtime.tv_nsec == sb.stx_mtime.tv_nsec;
+}
+
+static void parent_dir(const char *path, char *dir) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        strcpy(dir, ".");
+        return;
+    }
+    size_t len = slash == path ? 1 : (size_t)(slash - path);
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+}
+
+// Executors lend write permission in the same directories at once. Only
+// one lends at a time, so the mode lend_write looks at is never one
+// another thread lent and is about to take back.
+static pthread_mutex_t lend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Gives path owner write permission if it lacks it. Returns 1 with the
+// mode to put back in *was if it did; lend_return must follow.
+int lend_write(const char *path, mode_t *was) {
+    struct stat st;
+    pthread_mutex_lock(&lend_lock);
+    if (stat(path, &st) < 0 || (st.st_mode & S_IWUSR) ||
+        chmod(path, (st.st_mode & 07777) | S_IWUSR) < 0) {
+        pthread_mutex_unlock(&lend_lock);
+        return 0;
+    }
+    *was = st.st_mode & 07777;
+    return 1;
+}
+
+// Puts back the mode lend_write changed. Keeps errno.
+void lend_return(const char *path, mode_t was) {
+    int err = errno;
+    chmod(path, was);
+    pthread_mutex_unlock(&lend_lock);
+    errno = err;
+}
+
+// Opens a target file for our own writes. A mode replicated from the
+// source can leave the file, or the directory it is created in, without
+// owner write permission; that is lent for the open only, since the fd
+// keeps its access and the metadata copied afterwards is unchanged.
+int open_target(const char *path, int flags, mode_t mode) {
+    int fd = open(path, flags, mode);
+    if (fd >= 0 || errno != EACCES)
+        return fd;
+
+    char dir[PATH_MAX];
+    mode_t was;
+    const char *lent = path;
+    if (!lend_write(path, &was)) {
+        parent_dir(path, dir);
+        if (!lend_write(dir, &was)) {
+            errno = EACCES;
+            return -1;
+        }
+        lent = dir;
+    }
+    fd = open(path, flags, mode);
+    lend_return(lent, was);
+    return fd;
+}
+
+static int copy_path(const char *src, const char *dst, CopyResult *res,
+                     FileDigest *d) {
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+
+    int out = open_target(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    int rc = copy_fd_digest(in, out, res, d);
+
+    close(in);
+    if (close(out) < 0) rc = -1;
+    return rc;
+}
+
+int copy_file(const char *src, const char *dst, CopyResult *res) {
+    return copy_path(src, dst, res, NULL);
+}
+
+int copy_file_hashed(const char *src, const char *dst, CopyResult *res,
+                     HashAlgo algo, FileDigest *d) {
+    memset(d, 0, sizeof(*d));
+    d->algo = algo;
+    return copy_path(src, dst, res, d);
+}
+
+const char *copy_method_name(CopyMethod m) {
+    switch (m) {
+    case COPY_FILE_RANGE: return "copy_file_range";
+    case COPY_SENDFILE:   return "sendfile";
+    case COPY_SPLICE:     return "splice";
+    case COPY_READWRITE:  return "read/write";
+    case COPY_URING:      return "io_uring";
+    default:              return "none";
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "merkle.h"
+
+// Large copies move this much at a time, and may yield in between.
+#define COPY_CHUNK  (8 << 20)
+
+typedef void (*CopyYield)(void);
+
+typedef enum {
+    COPY_NONE,
+    COPY_FILE_RANGE,
+    COPY_SENDFILE,
+    COPY_SPLICE,
+    COPY_READWRITE,
+    COPY_URING
+} CopyMethod;
+
+typedef struct {
+    long long bytes;    // bytes moved so far
+    CopyMethod method;  // engine that moved the last chunk
+} CopyResult;
+
+int copy_range(int in, int out, off_t off, off_t len, CopyResult *res);
+int copy_fd(int in, int out, CopyResult *res);
+int copy_fd_hashed(int in, int out, CopyResult *res, HashAlgo algo,
+                   FileDigest *d);
+int copy_file(const char *src, const char *dst, CopyResult *res);
+int copy_file_hashed(const char *src, const char *dst, CopyResult *res,
+                     HashAlgo algo, FileDigest *d);
+const char *copy_method_name(CopyMethod m);
+void copy_set_xattrs(int on);
+void copy_set_yield(CopyYield fn);
+void copy_yield(void);
+void copy_cancel(void);
+int copy_cancelled(void);
+void copy_metadata(int in, int out, const struct stat *st);
+int same_size_mtime(const char *a, const char *b);
+int lend_write(const char *path, mode_t *was);
+void lend_return(const char *path, mode_t was);
+int open_target(const char *path, int flags, mode_t mode);
+
+#endif
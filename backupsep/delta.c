@@ -0,0 +1,194 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include "delta.h"
+#include "filestate.h"
+#include "copy.h"
+
+// Fixed-block delta sync. For every target file we have synced this way
+// the FileState keeps one digest per DELTA_BLOCK. On the next change
+// only the source is read; blocks whose digest moved are written into
+// the target in place. If the target was touched by anything else the
+// sums are rebuilt from the target first.
+//
+// When a file has them, the same sums let append.c check that it only
+// grew or shrank without reading the target.
+
+static int sums_reserve(FileState *fs, size_t n) {
+    if (n <= fs->cap)
+        return 0;
+    size_t cap = fs->cap * 2 > n ? fs->cap * 2 : n;
+    unsigned char (*sums)[BLOCK_SUM] = realloc(fs->sums, cap * sizeof(*sums));
+    if (!sums) return -1;
+    fs->sums = sums;
+    fs->cap = cap;
+    return 0;
+}
+
+static ssize_t read_block(int fd, unsigned char *buf, off_t off) {
+    size_t got = 0;
+    while (got < DELTA_BLOCK) {
+        ssize_t r = pread(fd, buf + got, DELTA_BLOCK - got, off + got);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        got += r;
+    }
+    return (ssize_t)got;
+}
+
+static int write_block(int fd, const unsigned char *buf, size_t len,
+                       off_t off) {
+    for (size_t w = 0; w < len; ) {
+        ssize_t r = pwrite(fd, buf + w, len - w, off + w);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        w += r;
+    }
+    return 0;
+}
+
+// Recomputes the sums from the block holding `from` to the end of fd.
+static int sums_build(FileState *fs, int fd, off_t from, unsigned char *buf) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+
+    size_t first = from / DELTA_BLOCK;
+    size_t n = (st.st_size + DELTA_BLOCK - 1) / DELTA_BLOCK;
+    if (!fs->has_sums) first = 0;
+    if (first > fs->nblocks) first = fs->nblocks;
+    fs->has_sums = 0;
+    fs->nblocks = first;
+    if (sums_reserve(fs, n) < 0) return -1;
+
+    for (size_t i = first; i < n; i++) {
+        ssize_t got = read_block(fd, buf, (off_t)i * DELTA_BLOCK);
+        if (got < 0 || copy_cancelled() || block_digest(buf, got, fs->sums[i]) < 0)
+            return -1;
+        if ((i + 1) % (COPY_CHUNK / DELTA_BLOCK) == 0)
+            copy_yield();
+    }
+    fs->nblocks = n;
+    fs->has_sums = 1;
+    filestate_record(fs, fd);
+    return 0;
+}
+
+// Sums the target fd from `from` on after it was written some other way.
+int delta_track(FileState *fs, int fd, off_t from) {
+    unsigned char *buf = malloc(DELTA_BLOCK);
+    int rc = buf ? sums_build(fs, fd, from, buf) : -1;
+    free(buf);
+    if (rc < 0)
+        fs->size = -1;
+    return rc;
+}
+
+// Whether the first len bytes of in are those of the target out, which
+// fs describes. Where the sums cover a block exactly, only in is read;
+// anything else (no sums, or a block the target has more of than len)
+// is compared byte for byte.
+int delta_verify(FileState *fs, int in, int out, off_t len) {
+    int sums = fs->has_sums && len <= fs->size &&
+        fs->nblocks == (size_t)((fs->size + DELTA_BLOCK - 1) / DELTA_BLOCK);
+
+    unsigned char *buf = malloc(DELTA_BLOCK), *theirs = NULL;
+    int same = buf != NULL;
+    for (size_t i = 0; same && (off_t)i * DELTA_BLOCK < len; i++) {
+        off_t off = (off_t)i * DELTA_BLOCK;
+        size_t want = len - off < DELTA_BLOCK ? len - off : DELTA_BLOCK;
+        unsigned char sum[BLOCK_SUM];
+        ssize_t got = read_block(in, buf, off);
+        if (got < (ssize_t)want || copy_cancelled()) {
+            same = 0;
+        } else if (sums && (want == DELTA_BLOCK || len == fs->size)) {
+            same = block_digest(buf, want, sum) == 0 &&
+                   !memcmp(fs->sums[i], sum, BLOCK_SUM);
+        } else {
+            same = (theirs || (theirs = malloc(DELTA_BLOCK))) &&
+                   read_block(out, theirs, off) >= (ssize_t)want &&
+                   !memcmp(buf, theirs, want);
+        }
+        if ((i + 1) % (COPY_CHUNK / DELTA_BLOCK) == 0)
+            copy_yield();
+    }
+    free(buf);
+    free(theirs);
+    return same;
+}
+
+int delta_sync(const char *src, const char *dst, DeltaResult *res) {
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return -1;
+    int out = open_target(dst, O_RDWR | O_CLOEXEC, 0);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+
+    unsigned char *buf = malloc(DELTA_BLOCK);
+    FileState *fs = filestate_get(dst, 1);
+    struct stat ss, ds;
+    int rc = -1;
+
+    if (!buf || !fs || fstat(in, &ss) < 0 || fstat(out, &ds) < 0 ||
+        !S_ISREG(ds.st_mode))
+        goto done;
+    if ((!fs->has_sums || !filestate_matches(fs, &ds)) &&
+        sums_build(fs, out, 0, buf) < 0)
+        goto done;
+
+    off_t off = 0;
+    for (size_t i = 0; ; i++, off += DELTA_BLOCK) {
+        ssize_t got = read_block(in, buf, off);
+        if (got < 0 || copy_cancelled()) goto done;
+        if (got == 0) break;
+
+        unsigned char sum[BLOCK_SUM];
+        if (sums_reserve(fs, i + 1) < 0 || block_digest(buf, got, sum) < 0)
+            goto done;
+        if (res) res->examined += got;
+
+        if (i >= fs->nblocks || memcmp(fs->sums[i], sum, BLOCK_SUM)) {
+            if (write_block(out, buf, got, off) < 0) goto done;
+            if (res) res->written += got;
+        }
+        memcpy(fs->sums[i], sum, BLOCK_SUM);
+        if (i >= fs->nblocks) fs->nblocks = i + 1;
+
+        if (got < DELTA_BLOCK) {
+            off += got;
+            break;
+        }
+        if ((i + 1) % (COPY_CHUNK / DELTA_BLOCK) == 0)
+            copy_yield();
+    }
+
+    if (off != ds.st_size && ftruncate(out, off) < 0)
+        goto done;
+    fs->nblocks = (off + DELTA_BLOCK - 1) / DELTA_BLOCK;
+    copy_metadata(in, out, &ss);
+    filestate_record(fs, out);
+    fs->checked = off;
+    rc = 0;
+
+done:
+    if (rc < 0 && fs)
+        fs->size = -1;   // force a rebuild next time
+    filestate_put(fs);
+    free(buf);
+    close(in);
+    close(out);
+    return rc;
+}
@@ -0,0 +1,18 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <sys/types.h>
+#include "filestate.h"
+
+#define DELTA_BLOCK (64 << 10)
+
+typedef struct {
+    long long examined;     // source bytes read
+    long long written;      // bytes rewritten in the target
+} DeltaResult;
+
+int delta_sync(const char *src, const char *dst, DeltaResult *res);
+int delta_track(FileState *fs, int fd, off_t from);
+int delta_verify(FileState *fs, int in, int out, off_t len);
+
+#endif
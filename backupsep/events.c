@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+#include <limits.h>
+#include <errno.h>
+#include "events.h"
+#include "watcher.h"
+#include "utils.h"
+#include "hash.h"
+
+// Change sources for the worker. The inotify backend keeps one watch per
+// source directory in the watch registry. The fanotify backend puts a
+// single FAN_MARK_FILESYSTEM mark on the source's filesystem and reports
+// directory handle + name; each event's directory is resolved back to a
+// path and anything outside the source is dropped. Either way the worker
+// sees Events with full paths and IN_* masks. Where the kernel has
+// FAN_RENAME, a fanotify rename arrives as one event and is handed on as
+// an IN_MOVED_FROM/IN_MOVED_TO pair sharing a made-up cookie, as inotify
+// would report it.
+//
+// Resolving a handle takes an open_by_handle_at and a readlink, and the
+// mark reports the whole filesystem, so the answer is cached per handle,
+// "outside the root" included. A directory renamed or removed anywhere
+// empties the cache, since paths below it may have changed.
+
+#define FAN_EVENTS (FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_CLOSE_WRITE | \
+                    FAN_ONDIR)
+#define FAN_MOVES (FAN_MOVED_FROM | FAN_MOVED_TO)
+#define DIR_CACHE 1024
+
+typedef struct {
+    int used;
+    int type;
+    unsigned bytes;
+    unsigned char handle[MAX_HANDLE_SZ];
+    char *path;             // NULL: outside the root
+} DirCache;
+
+struct EventSource {
+    EventBackend backend;
+    int fd;
+    int mount_fd;           // fanotify: any fd on the marked filesystem
+    uint32_t cookie;        // fanotify: last cookie handed out
+    DirCache *cache;        // fanotify: DIR_CACHE slots, or NULL
+    char root[PATH_MAX];
+};
+
+static int open_fanotify(EventSource *es) {
+    es->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                           FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY);
+    if (es->fd < 0)
+        return -1;
+    es->mount_fd = open(es->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    unsigned flags = FAN_MARK_ADD | FAN_MARK_FILESYSTEM;
+    if (es->mount_fd < 0 ||
+        (fanotify_mark(es->fd, flags, FAN_EVENTS | FAN_RENAME,
+                       AT_FDCWD, es->root) < 0 &&
+         fanotify_mark(es->fd, flags, FAN_EVENTS | FAN_MOVES,
+                       AT_FDCWD, es->root) < 0)) {
+        int err = errno;
+        if (es->mount_fd >= 0) close(es->mount_fd);
+        close(es->fd);
+        errno = err;
+        return -1;
+    }
+    es->backend = BACKEND_FANOTIFY;
+    es->cache = calloc(DIR_CACHE, sizeof(*es->cache));
+    return 0;
+}
+
+static void dir_cache_clear(EventSource *es) {
+    for (int i = 0; es->cache && i < DIR_CACHE; i++) {
+        free(es->cache[i].path);
+        es->cache[i].path = NULL;
+        es->cache[i].used = 0;
+    }
+}
+
+// Opens a change source for the tree at source (a real path). A refused
+// fanotify falls back to inotify.
+EventSource *events_open(const char *source, EventBackend backend) {
+    EventSource *es = calloc(1, sizeof(*es));
+    if (!es || strlen(source) >= sizeof(es->root)) {
+        free(es);
+        return NULL;
+    }
+    strcpy(es->root, source);
+    es->mount_fd = -1;
+
+    if (backend != BACKEND_INOTIFY && open_fanotify(es) == 0)
+        return es;
+    if (backend == BACKEND_FANOTIFY)
+        fprintf(stderr, "fanotify unavailable (%s), using inotify\n",
+                strerror(errno));
+
+    es->backend = BACKEND_INOTIFY;
+    es->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (es->fd < 0) {
+        free(es);
+        return NULL;
+    }
+    return es;
+}
+
+void events_close(EventSource *es) {
+    if (!es) return;
+    if (es->mount_fd >= 0) close(es->mount_fd);
+    close(es->fd);
+    dir_cache_clear(es);
+    free(es->cache);
+    free(es);
+}
+
+// Starts watching dir and everything below it. The filesystem mark
+// already covers new directories.
+void events_watch_tree(EventSource *es, const char *dir) {
+    if (es->backend == BACKEND_INOTIFY)
+        add_watches_recursive(es->fd, dir);
+}
+
+// Watches dir alone, as when a rescan finds it may have gone unwatched.
+void events_watch_dir(EventSource *es, const char *dir) {
+    if (es->backend == BACKEND_INOTIFY)
+        add_watch(es->fd, dir);
+}
+
+// Tells the registry that a watched directory was renamed within the
+// source; its watches stay valid.
+void events_moved(EventSource *es, const char *from, const char *to) {
+    if (es->backend == BACKEND_INOTIFY)
+        move_watch(from, to);
+}
+
+// Stops watching a directory that has left the source.
+void events_unwatch_tree(EventSource *es, const char *dir) {
+    if (es->backend == BACKEND_INOTIFY)
+        remove_watch_tree(es->fd, dir);
+}
+
+int events_fd(const EventSource *es) {
+    return es->fd;
+}
+
+const char *events_backend_name(const EventSource *es) {
+    return es->backend == BACKEND_FANOTIFY ? "fanotify" : "inotify";
+}
+
+static int parse_inotify(EventSource *es, const char *buf, size_t len,
+                         EventFn fn, void *arg) {
+    int count = 0;
+    for (const char *ptr = buf; ptr < buf + len; ) {
+        const struct inotify_event *ie = (const void *)ptr;
+        ptr += sizeof(struct inotify_event) + ie->len;
+
+        if (ie->mask & IN_IGNORED) {
+            remove_watch_by_wd(ie->wd);
+            continue;
+        }
+        char path[PATH_MAX];
+        Event ev = {ie->mask, ie->cookie, ie->wd, path};
+        const char *dir = NULL;
+        if (!(ie->mask & IN_Q_OVERFLOW) && !(dir = get_watch_path(ie->wd)))
+            ev.mask = IN_Q_OVERFLOW;    // a watch we lost track of
+        if (ev.mask & IN_Q_OVERFLOW) {
+            ev.path = es->root;
+        } else {
+            int n;
+            if (ie->len)
+                n = snprintf(path, sizeof(path), "%s/%s", dir, ie->name);
+            else
+                n = snprintf(path, sizeof(path), "%s", dir);
+            if (n < 0 || n >= (int)sizeof(path))
+                continue;
+        }
+        fn(&ev, arg);
+        count++;
+    }
+    return count;
+}
+
+static uint32_t fan_to_in(uint64_t mask) {
+    uint32_t in = 0;
+    if (mask & FAN_CREATE)     in |= IN_CREATE;
+    if (mask & FAN_DELETE)     in |= IN_DELETE;
+    if (mask & FAN_MODIFY)     in |= IN_MODIFY;
+    if (mask & FAN_CLOSE_WRITE) in |= IN_CLOSE_WRITE;
+    if (mask & FAN_MOVED_FROM) in |= IN_MOVED_FROM;
+    if (mask & FAN_MOVED_TO)   in |= IN_MOVED_TO;
+    if (mask & FAN_ONDIR)      in |= IN_ISDIR;
+    if (mask & FAN_Q_OVERFLOW) in |= IN_Q_OVERFLOW;
+    return in;
+}
+
+// Path of the directory behind a file handle, or -1 if it is gone.
+static int handle_path(EventSource *es, struct file_handle *fh, char *out) {
+    char proc[64];
+    int fd = open_by_handle_at(es->mount_fd, fh, O_PATH | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(proc, out, PATH_MAX - 1);
+    close(fd);
+    if (n < 0)
+        return -1;
+    out[n] = '\0';
+    return 0;
+}
+
+// Path of a directory below the root behind a file handle, or -1 if it
+// is gone or outside the root.
+static int dir_path(EventSource *es, struct file_handle *fh, char *out) {
+    DirCache *c = NULL;
+    if (es->cache && fh->handle_bytes <= MAX_HANDLE_SZ) {
+        uint64_t h = hash64(fh->f_handle, fh->handle_bytes) ^
+                     (unsigned)fh->handle_type;
+        c = &es->cache[h % DIR_CACHE];
+        if (c->used && c->type == fh->handle_type &&
+            c->bytes == fh->handle_bytes &&
+            !memcmp(c->handle, fh->f_handle, fh->handle_bytes)) {
+            if (!c->path)
+                return -1;
+            strcpy(out, c->path);
+            return 0;
+        }
+    }
+
+    if (handle_path(es, fh, out) < 0)
+        return -1;      // gone: nothing to cache
+    int inside = is_subpath(es->root, out);
+    if (c) {
+        free(c->path);
+        c->path = inside ? strdup(out) : NULL;
+        c->used = !inside || c->path;
+        c->type = fh->handle_type;
+        c->bytes = fh->handle_bytes;
+        memcpy(c->handle, fh->f_handle, fh->handle_bytes);
+    }
+    return inside ? 0 : -1;
+}
+
+// Resolves the record of the given type to a full path below the root.
+static int fan_path(EventSource *es, const struct fanotify_event_metadata *m,
+                    int type, char *out) {
+    const char *p = (const char *)m + m->metadata_len;
+    const char *end = (const char *)m + m->event_len;
+
+    while (p + sizeof(struct fanotify_event_info_header) <= end) {
+        const struct fanotify_event_info_fid *fid = (const void *)p;
+        if (fid->hdr.len == 0)
+            break;
+        if (fid->hdr.info_type == type) {
+            struct file_handle *fh = (struct file_handle *)fid->handle;
+            const char *name = (const char *)fh->f_handle +
+                               fh->handle_bytes;
+            char dir[PATH_MAX];
+            if (dir_path(es, fh, dir) < 0)
+                return -1;
+            int n = snprintf(out, PATH_MAX, "%s/%s", dir, name);
+            return n < 0 || n >= PATH_MAX ? -1 : 0;
+        }
+        p += fid->hdr.len;
+    }
+    return -1;
+}
+
+static int parse_fanotify(EventSource *es, const char *buf, size_t size,
+                          EventFn fn, void *arg) {
+    int count = 0;
+    long len = (long)size;
+    const struct fanotify_event_metadata *m = (const void *)buf;
+    for (; FAN_EVENT_OK(m, len); m = FAN_EVENT_NEXT(m, len)) {
+        if (m->vers != FANOTIFY_METADATA_VERSION)
+            break;
+        if (m->fd >= 0)
+            close(m->fd);
+        if ((m->mask & FAN_ONDIR) &&
+            (m->mask & (FAN_RENAME | FAN_MOVES | FAN_DELETE)))
+            dir_cache_clear(es);
+        char path[PATH_MAX];
+        Event ev = {fan_to_in(m->mask), 0, -1, path};
+
+        if (m->mask & FAN_RENAME) {
+            char to[PATH_MAX];
+            int from_ok = fan_path(es, m, FAN_EVENT_INFO_TYPE_OLD_DFID_NAME,
+                                   path) == 0;
+            int to_ok = fan_path(es, m, FAN_EVENT_INFO_TYPE_NEW_DFID_NAME,
+                                 to) == 0;
+            uint32_t dir = m->mask & FAN_ONDIR ? IN_ISDIR : 0;
+            uint32_t cookie = 0;
+            if (from_ok && to_ok && !(cookie = ++es->cookie))
+                cookie = ++es->cookie;
+            if (from_ok) {
+                Event from = {IN_MOVED_FROM | dir, cookie, -1, path};
+                fn(&from, arg);
+                count++;
+            }
+            if (to_ok) {
+                Event dest = {IN_MOVED_TO | dir, cookie, -1, to};
+                fn(&dest, arg);
+                count++;
+            }
+            continue;
+        }
+        if (ev.mask & IN_Q_OVERFLOW) {
+            ev.path = es->root;
+        } else if (fan_path(es, m, FAN_EVENT_INFO_TYPE_DFID_NAME, path) < 0) {
+            continue;
+        }
+
+        // fanotify merges events on one name; what exists now decides
+        // whether it was created or removed.
+        uint32_t added = IN_CREATE | IN_MOVED_TO;
+        uint32_t gone = IN_DELETE | IN_MOVED_FROM;
+        if ((ev.mask & added) && (ev.mask & gone)) {
+            struct stat st;
+            ev.mask &= lstat(path, &st) == 0 ? ~gone : ~added;
+        }
+        fn(&ev, arg);
+        count++;
+    }
+    return count;
+}
+
+// Reads pending events into buf without decoding them, so the kernel
+// queue can be drained by a thread that does not own the watch state.
+// buf must be aligned for any event. Returns the bytes read, or -1 with
+// errno EAGAIN when none are pending.
+ssize_t events_fetch(const EventSource *es, void *buf, size_t size) {
+    return read(es->fd, buf, size);
+}
+
+// Delivers the events in a buffer filled by events_fetch. Returns how
+// many.
+int events_parse(EventSource *es, const void *buf, size_t len, EventFn fn,
+                 void *arg) {
+    if (es->backend == BACKEND_FANOTIFY)
+        return parse_fanotify(es, buf, len, fn, arg);
+    return parse_inotify(es, buf, len, fn, arg);
+}
@@ -0,0 +1,42 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/inotify.h>
+
+typedef enum {
+    BACKEND_INOTIFY,    // one watch per directory
+    BACKEND_FANOTIFY,   // one filesystem mark, needs CAP_SYS_ADMIN
+    BACKEND_AUTO        // fanotify if permitted, else inotify
+} EventBackend;
+
+// One change below the source, whatever backend saw it. mask uses the
+// IN_* bits; fanotify events are translated.
+typedef struct {
+    uint32_t mask;
+    uint32_t cookie;        // pairs IN_MOVED_FROM/IN_MOVED_TO, or 0
+    int wd;                 // inotify watch, -1 under fanotify
+    const char *path;       // full source path of the entry
+} Event;
+
+// Smallest read buffer: room for any one event with a full name.
+#define EVENT_BUF_MIN 4096
+
+typedef struct EventSource EventSource;
+typedef void (*EventFn)(const Event *ev, void *arg);
+
+EventSource *events_open(const char *source, EventBackend backend);
+void events_close(EventSource *es);
+void events_watch_tree(EventSource *es, const char *dir);
+void events_watch_dir(EventSource *es, const char *dir);
+void events_moved(EventSource *es, const char *from, const char *to);
+void events_unwatch_tree(EventSource *es, const char *dir);
+ssize_t events_fetch(const EventSource *es, void *buf, size_t size);
+int events_parse(EventSource *es, const void *buf, size_t len, EventFn fn,
+                 void *arg);
+int events_fd(const EventSource *es);
+const char *events_backend_name(const EventSource *es);
+
+#endif
@@ -0,0 +1,262 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include "executor.h"
+#include "hash.h"
+
+// Each thread owns one shard, with a FIFO of jobs per priority class. A
+// job goes to the shard its key hashes to, so jobs on different keys
+// usually land on different threads and run side by side. Anything that
+// has to see the effects of every job before it (a directory created or
+// removed, a rename) waits in executor_barrier until all shards are
+// empty.
+//
+// A shard runs the job due first: the oldest, counting each class it is
+// behind as PRIO_AGING_MS of waiting, so bulk work still gets its turn.
+// Long jobs call executor_yield between chunks, which runs the more
+// urgent jobs queued by then before returning to the chunk.
+//
+// Jobs on one key keep their order because a job is never queued in a
+// less urgent class than one still pending on its key: it is raised to
+// that class instead, and queued behind it. Keys are counted per slot,
+// so keys sharing a slot only ever wait a little longer.
+
+#define PRIO_AGING_MS 2000
+#define KEY_SLOTS 1024
+
+typedef struct {
+    JobFn fn;
+    void *job;
+    long long since;        // ms, when submitted
+    unsigned slot;
+    JobPrio prio;
+} Job;
+
+typedef struct {
+    Job *items;             // live jobs are items[head..tail)
+    size_t head, tail, cap;
+} Fifo;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Fifo queue[NPRIO];
+    unsigned pending[KEY_SLOTS][NPRIO];     // queued or running
+    int running;            // class of the innermost job running
+    int stop;
+    pthread_t thread;
+    struct Executor *x;
+} Shard;
+
+struct Executor {
+    Shard *shards;
+    int nshards;
+    long pending;           // submitted and not yet finished
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+};
+
+// The shard of the calling thread, for executor_yield.
+static pthread_key_t current;
+static pthread_once_t current_once = PTHREAD_ONCE_INIT;
+
+static void make_current(void) {
+    pthread_key_create(&current, NULL);
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void finished(Executor *x) {
+    pthread_mutex_lock(&x->idle_lock);
+    if (--x->pending == 0)
+        pthread_cond_broadcast(&x->idle);
+    pthread_mutex_unlock(&x->idle_lock);
+}
+
+// The class whose head is due first among those more urgent than below,
+// considering only jobs submitted by `by`; -1 if there is none.
+static int pick(const Shard *s, int below, long long by) {
+    int best = -1;
+    long long due = 0;
+    for (int c = 0; c < below; c++) {
+        const Fifo *q = &s->queue[c];
+        if (q->head == q->tail || q->items[q->head].since > by)
+            continue;
+        long long d = q->items[q->head].since + c * PRIO_AGING_MS;
+        if (best < 0 || d < due) {
+            best = c;
+            due = d;
+        }
+    }
+    return best;
+}
+
+// Runs the head of class c. Called and returns with the lock held.
+static void run(Shard *s, int c) {
+    Fifo *q = &s->queue[c];
+    Job j = q->items[q->head++];
+    int outer = s->running;
+    s->running = c;
+    pthread_mutex_unlock(&s->lock);
+    j.fn(j.job);
+    finished(s->x);
+    pthread_mutex_lock(&s->lock);
+    s->pending[j.slot][j.prio]--;
+    s->running = outer;
+}
+
+static void *shard_main(void *arg) {
+    Shard *s = arg;
+    pthread_setspecific(current, s);
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        int c;
+        while ((c = pick(s, NPRIO, LLONG_MAX)) < 0 && !s->stop)
+            pthread_cond_wait(&s->ready, &s->lock);
+        if (c < 0)
+            break;
+        run(s, c);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// Called by a running job at a point where it can stop for a while.
+// Does nothing on threads that are not the pool's.
+void executor_yield(void) {
+    pthread_once(&current_once, make_current);
+    Shard *s = pthread_getspecific(current);
+    if (!s) return;
+
+    // Only what is queued now, so a stream of small jobs cannot keep
+    // the one yielding from its next chunk.
+    long long by = now_ms();
+    pthread_mutex_lock(&s->lock);
+    int c;
+    while ((c = pick(s, s->running, by)) >= 0)
+        run(s, c);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static int push(Fifo *q, Job j) {
+    if (q->tail == q->cap) {
+        if (q->head > 0) {
+            memmove(q->items, q->items + q->head,
+                    (q->tail - q->head) * sizeof(*q->items));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            size_t cap = q->cap ? q->cap * 2 : 64;
+            Job *items = realloc(q->items, cap * sizeof(*items));
+            if (!items)
+                return -1;
+            q->items = items;
+            q->cap = cap;
+        }
+    }
+    q->items[q->tail++] = j;
+    return 0;
+}
+
+Executor *executor_start(int threads) {
+    pthread_once(&current_once, make_current);
+    Executor *x = calloc(1, sizeof(*x));
+    if (!x || !(x->shards = calloc(threads, sizeof(*x->shards)))) {
+        free(x);
+        return NULL;
+    }
+    pthread_mutex_init(&x->idle_lock, NULL);
+    pthread_cond_init(&x->idle, NULL);
+    for (int i = 0; i < threads; i++) {
+        Shard *s = &x->shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_cond_init(&s->ready, NULL);
+        s->running = NPRIO;
+        s->x = x;
+        if (pthread_create(&s->thread, NULL, shard_main, s) != 0) {
+            perror("executor");
+            break;
+        }
+        x->nshards++;
+    }
+    if (x->nshards == 0) {
+        free(x->shards);
+        free(x);
+        return NULL;
+    }
+    return x;
+}
+
+// Queues fn(job) behind every job submitted earlier with the same key.
+// Runs it right here if it cannot be queued.
+void executor_submit(Executor *x, const char *key, JobPrio prio, JobFn fn,
+                     void *job) {
+    uint64_t h = hash64(key, strlen(key));
+    Shard *s = &x->shards[h % x->nshards];
+    Job j = {fn, job, now_ms(), (unsigned)(h / x->nshards % KEY_SLOTS),
+             prio};
+
+    // Counted before it is queued, so the thread finishing it cannot
+    // take pending below zero.
+    pthread_mutex_lock(&x->idle_lock);
+    x->pending++;
+    pthread_mutex_unlock(&x->idle_lock);
+
+    pthread_mutex_lock(&s->lock);
+    for (int c = NPRIO - 1; c > (int)j.prio; c--)
+        if (s->pending[j.slot][c])
+            j.prio = c;
+    int rc = push(&s->queue[j.prio], j);
+    if (rc == 0) {
+        s->pending[j.slot][j.prio]++;
+        pthread_cond_signal(&s->ready);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (rc < 0) {
+        // Out of memory: keep the order by letting everything queued
+        // finish first.
+        finished(x);
+        executor_barrier(x);
+        fn(job);
+    }
+}
+
+// Waits until every job submitted so far has finished.
+void executor_barrier(Executor *x) {
+    pthread_mutex_lock(&x->idle_lock);
+    while (x->pending > 0)
+        pthread_cond_wait(&x->idle, &x->idle_lock);
+    pthread_mutex_unlock(&x->idle_lock);
+}
+
+// Finishes the queued jobs and ends the threads.
+void executor_stop(Executor *x) {
+    if (!x) return;
+    for (int i = 0; i < x->nshards; i++) {
+        Shard *s = &x->shards[i];
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_signal(&s->ready);
+        pthread_mutex_unlock(&s->lock);
+    }
+    for (int i = 0; i < x->nshards; i++) {
+        Shard *s = &x->shards[i];
+        pthread_join(s->thread, NULL);
+        for (int c = 0; c < NPRIO; c++)
+            free(s->queue[c].items);
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->ready);
+    }
+    pthread_mutex_destroy(&x->idle_lock);
+    pthread_cond_destroy(&x->idle);
+    free(x->shards);
+    free(x);
+}
@@ -0,0 +1,24 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+// A pool of threads applying jobs in parallel. Jobs are sharded by key:
+// those with the same key run one at a time, in the order submitted.
+// Within a shard, more urgent classes go first.
+typedef struct Executor Executor;
+typedef void (*JobFn)(void *job);
+
+typedef enum {
+    PRIO_URGENT,    // small and quick: run ahead of everything
+    PRIO_NORMAL,    // live changes that take a while
+    PRIO_BULK,      // catching up; runs when nothing else waits
+    NPRIO
+} JobPrio;
+
+Executor *executor_start(int threads);
+void executor_submit(Executor *x, const char *key, JobPrio prio, JobFn fn,
+                     void *job);
+void executor_yield(void);
+void executor_barrier(Executor *x);
+void executor_stop(Executor *x);
+
+#endif
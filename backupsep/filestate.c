@@ -0,0 +1,184 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "filestate.h"
+#include "hash.h"
+#include "utils.h"
+
+#define STATE_BUCKETS 1024
+#define STATE_MAX 4096  // records kept; the least recently used go first
+
+// The table is shared by the worker's executors. A record belongs to one
+// target path and no two executors work on one path at once, so only
+// the table itself is locked, not the records. A record in use is never
+// evicted; tree operations only come once the executors are settled.
+static FileState *states[STATE_BUCKETS];
+static FileState *newest, *oldest;
+static int count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned path_bucket(const char *s) {
+    unsigned h = 5381;
+    while (*s)
+        h = h * 33 + (unsigned char)*s++;
+    return h % STATE_BUCKETS;
+}
+
+static void lru_unlink(FileState *fs) {
+    if (fs->newer) fs->newer->older = fs->older;
+    else newest = fs->older;
+    if (fs->older) fs->older->newer = fs->newer;
+    else oldest = fs->newer;
+}
+
+static void lru_push(FileState *fs) {
+    fs->newer = NULL;
+    fs->older = newest;
+    if (newest) newest->newer = fs;
+    else oldest = fs;
+    newest = fs;
+}
+
+static void bucket_add(FileState *fs) {
+    unsigned b = path_bucket(fs->path);
+    fs->next = states[b];
+    states[b] = fs;
+}
+
+static void bucket_remove(FileState *fs) {
+    FileState **pp = &states[path_bucket(fs->path)];
+    while (*pp != fs)
+        pp = &(*pp)->next;
+    *pp = fs->next;
+}
+
+static void drop_locked(FileState *fs) {
+    bucket_remove(fs);
+    lru_unlink(fs);
+    count--;
+    free(fs->path);
+    free(fs->sums);
+    free(fs);
+}
+
+static FileState *find_locked(const char *path) {
+    FileState *fs = states[path_bucket(path)];
+    while (fs && strcmp(fs->path, path))
+        fs = fs->next;
+    return fs;
+}
+
+// Pass filestate_put the record once done with it.
+FileState *filestate_get(const char *path, int create) {
+    pthread_mutex_lock(&lock);
+    FileState *fs = find_locked(path);
+    if (fs) {
+        lru_unlink(fs);
+    } else if (create && (fs = calloc(1, sizeof(*fs)))) {
+        if (!(fs->path = strdup(path))) {
+            free(fs);
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        fs->size = -1;
+        bucket_add(fs);
+        count++;
+        for (FileState *o = oldest; o && count > STATE_MAX; ) {
+            FileState *newer = o->newer;
+            if (!o->users)
+                drop_locked(o);
+            o = newer;
+        }
+    }
+    if (fs) {
+        lru_push(fs);
+        fs->users++;
+    }
+    pthread_mutex_unlock(&lock);
+    return fs;
+}
+
+void filestate_put(FileState *fs) {
+    if (!fs) return;
+    pthread_mutex_lock(&lock);
+    fs->users--;
+    pthread_mutex_unlock(&lock);
+}
+
+static void forget_locked(const char *path, int tree) {
+    if (!tree) {
+        FileState *fs = find_locked(path);
+        if (fs) drop_locked(fs);
+        return;
+    }
+    for (FileState *fs = oldest; fs; ) {
+        FileState *newer = fs->newer;
+        if (is_subpath(path, fs->path))
+            drop_locked(fs);
+        fs = newer;
+    }
+}
+
+// Re-keys the record for a file renamed from `from` to `to`, or with
+// tree, those of everything below a directory renamed so. A rename
+// keeps the inode, size and mtime they are checked against.
+void filestate_move(const char *from, const char *to, int tree) {
+    size_t len = strlen(from);
+    pthread_mutex_lock(&lock);
+    forget_locked(to, tree);
+    for (FileState *fs = tree ? oldest : find_locked(from); fs; ) {
+        FileState *newer = tree ? fs->newer : NULL;
+        if (is_subpath(from, fs->path)) {
+            char *path = malloc(strlen(to) + strlen(fs->path + len) + 1);
+            bucket_remove(fs);
+            if (path) {
+                sprintf(path, "%s%s", to, fs->path + len);
+                free(fs->path);
+                fs->path = path;
+                bucket_add(fs);
+            } else {
+                bucket_add(fs);
+                drop_locked(fs);
+            }
+        }
+        fs = newer;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void filestate_forget(const char *path, int tree) {
+    pthread_mutex_lock(&lock);
+    forget_locked(path, tree);
+    pthread_mutex_unlock(&lock);
+}
+
+int filestate_matches(const FileState *fs, const struct stat *st) {
+    return fs->size == st->st_size && fs->ino == st->st_ino &&
+           fs->mtime.tv_sec == st->st_mtim.tv_sec &&
+           fs->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+void filestate_record(FileState *fs, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fs->size = -1;
+        return;
+    }
+    fs->size = st.st_size;
+    fs->ino = st.st_ino;
+    fs->mtime = st.st_mtim;
+}
+
+int block_digest(const void *buf, size_t n, unsigned char out[BLOCK_SUM]) {
+    unsigned char d[HASH_MAX_DIGEST];
+    if (hash_buffer(HASH_SHA256, buf, n, d) != BLOCK_SUM)
+        return -1;
+    memcpy(out, d, BLOCK_SUM);
+    return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef FILESTATE_H
+#define FILESTATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Per-block digests are SHA-256: a block whose digest matches is not
+// rewritten, so a collision would leave stale data in the target.
+#define BLOCK_SUM 32
+
+// What the worker remembers about a target file it has written. The
+// record is only trusted while the target still has the size, inode
+// and mtime it had right after our last write.
+typedef struct FileState {
+    struct FileState *next;
+    struct FileState *newer, *older;    // in order of last use
+    int users;              // between filestate_get and filestate_put
+    char *path;             // target path
+    off_t size;             // -1 once the record is stale
+    ino_t ino;
+    struct timespec mtime;
+    off_t checked;          // bytes last known equal to the source
+    off_t probe;            // where append.c samples next
+    int has_sums;           // sums[] describe the replicated content
+    size_t nblocks, cap;
+    unsigned char (*sums)[BLOCK_SUM];   // one digest per DELTA_BLOCK
+} FileState;
+
+FileState *filestate_get(const char *path, int create);
+void filestate_put(FileState *fs);
+void filestate_forget(const char *path, int tree);
+void filestate_move(const char *from, const char *to, int tree);
+int filestate_matches(const FileState *fs, const struct stat *st);
+void filestate_record(FileState *fs, int fd);
+int block_digest(const void *buf, size_t n, unsigned char out[BLOCK_SUM]);
+
+#endif
@@ -0,0 +1,327 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include "hash.h"
+
+// Content hashes. HASH_FAST is built for change detection: input is cut
+// into 64-byte stripes, each stripe feeds eight 64-bit lanes with a
+// 32x32->64 multiply of the data against a key, and every 1 KB block the
+// lanes are scrambled. The lanes are independent, so the inner loop maps
+// directly onto SSE2/AVX2; the kernel is picked at runtime and every
+// kernel produces the same digest. HASH_SHA256 goes through OpenSSL.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HASH_X86 1
+#include <immintrin.h>
+#endif
+
+#define STRIPE 64
+#define STRIPES (HASH_BLOCK / STRIPE)
+#define PRIME32 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define FAST_DIGEST 16
+
+// Stripe s uses keys [s, s + 8); the scramble uses [16, 24).
+static const uint64_t secret[24] = {
+    0xb3315ad89407e6c3ULL, 0xa977c1a57d89ce24ULL, 0xe6b33c3aa102a941ULL,
+    0xa63e4075a580e514ULL, 0x74d5a45e3827fb3fULL, 0x1d1525d2570e60d6ULL,
+    0x2bbbf1318a79a0a9ULL, 0xbe1e4ffcb39ac6fbULL, 0x5b33921e2cde1b9cULL,
+    0xc0aacef72266371dULL, 0xf51ac6a2d3808a1aULL, 0x12e2ddf4742c2c37ULL,
+    0x51030812d526028bULL, 0x2dfafb9f3fdc4794ULL, 0x5994d00d234e15d9ULL,
+    0xfd11614d55d6273eULL, 0xd79f0744a3bc1bebULL, 0xd41c726a6c337c57ULL,
+    0x2a92d9b75eebad4cULL, 0x34a8a35a3ba9c8b2ULL, 0xb9295e1d72d94761ULL,
+    0x9340a26f076832aeULL, 0x0ebf27f82eda6af6ULL, 0xd89f0a74b74e82fbULL,
+};
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// Stripes first .. first + n - 1 of a block.
+static void stripes_scalar(uint64_t *acc, const unsigned char *p,
+                           size_t first, size_t n) {
+    for (size_t s = first; s < first + n; s++, p += STRIPE) {
+        for (int i = 0; i < 8; i++) {
+            uint64_t v = read64(p + 8 * i);
+            uint64_t k = v ^ secret[s + i];
+            acc[i ^ 1] += v;
+            acc[i] += (k & 0xffffffffULL) * (k >> 32);
+        }
+    }
+}
+
+static void blocks_scalar(uint64_t *acc, const unsigned char *p, size_t n) {
+    for (size_t b = 0; b < n; b++, p += HASH_BLOCK) {
+        stripes_scalar(acc, p, 0, STRIPES);
+        for (int i = 0; i < 8; i++) {
+            acc[i] ^= acc[i] >> 47;
+            acc[i] ^= secret[16 + i];
+            acc[i] *= PRIME32;
+        }
+    }
+}
+
+#ifdef HASH_X86
+__attribute__((target("sse2")))
+static void blocks_sse2(uint64_t *acc, const unsigned char *p, size_t n) {
+    __m128i a[4];
+    const __m128i prime = _mm_set1_epi32((int)PRIME32);
+    for (int i = 0; i < 4; i++)
+        a[i] = _mm_loadu_si128((const __m128i *)(acc + 2 * i));
+
+    for (size_t b = 0; b < n; b++, p += HASH_BLOCK) {
+        for (int s = 0; s < STRIPES; s++) {
+            const unsigned char *q = p + s * STRIPE;
+            for (int i = 0; i < 4; i++) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(q + 16 * i));
+                __m128i k = _mm_xor_si128(v, _mm_loadu_si128(
+                    (const __m128i *)(secret + s + 2 * i)));
+                __m128i m = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+                a[i] = _mm_add_epi64(a[i], _mm_shuffle_epi32(v, 0x4E));
+                a[i] = _mm_add_epi64(a[i], m);
+            }
+        }
+        for (int i = 0; i < 4; i++) {
+            __m128i x = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+            x = _mm_xor_si128(x, _mm_loadu_si128(
+                (const __m128i *)(secret + 16 + 2 * i)));
+            __m128i lo = _mm_mul_epu32(x, prime);
+            __m128i hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+            a[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        }
+    }
+    for (int i = 0; i < 4; i++)
+        _mm_storeu_si128((__m128i *)(acc + 2 * i), a[i]);
+}
+
+__attribute__((target("avx2")))
+static void blocks_avx2(uint64_t *acc, const unsigned char *p, size_t n) {
+    __m256i a[2];
+    const __m256i prime = _mm256_set1_epi32((int)PRIME32);
+    for (int i = 0; i < 2; i++)
+        a[i] = _mm256_loadu_si256((const __m256i *)(acc + 4 * i));
+
+    for (size_t b = 0; b < n; b++, p += HASH_BLOCK) {
+        for (int s = 0; s < STRIPES; s++) {
+            const unsigned char *q = p + s * STRIPE;
+            for (int i = 0; i < 2; i++) {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(q + 32 * i));
+                __m256i k = _mm256_xor_si256(v, _mm256_loadu_si256(
+                    (const __m256i *)(secret + s + 4 * i)));
+                __m256i m = _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32));
+                a[i] = _mm256_add_epi64(a[i], _mm256_shuffle_epi32(v, 0x4E));
+                a[i] = _mm256_add_epi64(a[i], m);
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            __m256i x = _mm256_xor_si256(a[i], _mm256_srli_epi64(a[i], 47));
+            x = _mm256_xor_si256(x, _mm256_loadu_si256(
+                (const __m256i *)(secret + 16 + 4 * i)));
+            __m256i lo = _mm256_mul_epu32(x, prime);
+            __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime);
+            a[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+        }
+    }
+    for (int i = 0; i < 2; i++)
+        _mm256_storeu_si256((__m256i *)(acc + 4 * i), a[i]);
+}
+#endif
+
+typedef void (*BlockFn)(uint64_t *acc, const unsigned char *p, size_t n);
+
+static const struct {
+    const char *name;
+    BlockFn fn;
+} kernels[] = {
+#ifdef HASH_X86
+    {"avx2", blocks_avx2},
+    {"sse2", blocks_sse2},
+#endif
+    {"scalar", blocks_scalar},
+};
+
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static int kernel = -1;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static int kernel_supported(int k) {
+#ifdef HASH_X86
+    __builtin_cpu_init();
+    if (!strcmp(kernels[k].name, "avx2"))
+        return __builtin_cpu_supports("avx2");
+    if (!strcmp(kernels[k].name, "sse2"))
+        return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+// The first supported kernel in the table is the fastest.
+static void pick_kernel(void) {
+    if (kernel >= 0) return;
+    for (size_t k = 0; k < NKERNELS && kernel < 0; k++)
+        if (kernel_supported((int)k))
+            kernel = (int)k;
+}
+
+const char *hash_impl(void) {
+    pthread_once(&kernel_once, pick_kernel);
+    return kernels[kernel].name;
+}
+
+// Forces a kernel, for benchmarks. Returns -1 if the CPU lacks it.
+int hash_select(const char *impl) {
+    for (size_t k = 0; k < NKERNELS; k++) {
+        if (!strcmp(kernels[k].name, impl)) {
+            if (!kernel_supported((int)k))
+                return -1;
+            pthread_once(&kernel_once, pick_kernel);
+            kernel = (int)k;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int hash_init(HashCtx *ctx, HashAlgo algo) {
+    ctx->algo = algo;
+    ctx->md = NULL;
+    if (algo == HASH_SHA256) {
+        EVP_MD_CTX *md = EVP_MD_CTX_new();
+        if (!md || EVP_DigestInit_ex(md, EVP_sha256(), NULL) != 1) {
+            EVP_MD_CTX_free(md);
+            return -1;
+        }
+        ctx->md = md;
+        return 0;
+    }
+
+    pthread_once(&kernel_once, pick_kernel);
+    for (int i = 0; i < 8; i++)
+        ctx->acc[i] = secret[i] ^ (i & 1 ? PRIME64_2 : PRIME64_1);
+    ctx->buffered = 0;
+    ctx->total = 0;
+    return 0;
+}
+
+void hash_update(HashCtx *ctx, const void *data, size_t len) {
+    if (ctx->algo == HASH_SHA256) {
+        EVP_DigestUpdate(ctx->md, data, len);
+        return;
+    }
+
+    const unsigned char *p = data;
+    ctx->total += len;
+    if (ctx->buffered) {
+        size_t take = HASH_BLOCK - ctx->buffered;
+        if (take > len) take = len;
+        memcpy(ctx->buf + ctx->buffered, p, take);
+        ctx->buffered += take;
+        p += take;
+        len -= take;
+        if (ctx->buffered < HASH_BLOCK)
+            return;
+        kernels[kernel].fn(ctx->acc, ctx->buf, 1);
+        ctx->buffered = 0;
+    }
+    size_t blocks = len / HASH_BLOCK;
+    if (blocks) {
+        kernels[kernel].fn(ctx->acc, p, blocks);
+        p += blocks * HASH_BLOCK;
+        len -= blocks * HASH_BLOCK;
+    }
+    memcpy(ctx->buf, p, len);
+    ctx->buffered = len;
+}
+
+// Low and high halves of a 64x64 product, folded together.
+static uint64_t mul_fold(uint64_t a, uint64_t b) {
+    uint64_t al = a & 0xffffffffULL, ah = a >> 32;
+    uint64_t bl = b & 0xffffffffULL, bh = b >> 32;
+    uint64_t ll = al * bl, lh = al * bh, hl = ah * bl, hh = ah * bh;
+    uint64_t mid = (ll >> 32) + (lh & 0xffffffffULL) + (hl & 0xffffffffULL);
+    uint64_t lo = (ll & 0xffffffffULL) | (mid << 32);
+    uint64_t hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+    return lo ^ hi;
+}
+
+static uint64_t avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ULL;
+    return h ^ (h >> 32);
+}
+
+static uint64_t merge(const uint64_t *acc, int key, uint64_t seed) {
+    uint64_t h = seed;
+    for (int i = 0; i < 8; i += 2)
+        h += mul_fold(acc[i] ^ secret[key + i], acc[i + 1] ^ secret[key + i + 1]);
+    return avalanche(h);
+}
+
+size_t hash_final(HashCtx *ctx, unsigned char out[HASH_MAX_DIGEST]) {
+    if (ctx->algo == HASH_SHA256) {
+        unsigned int n = 0;
+        EVP_DigestFinal_ex(ctx->md, out, &n);
+        EVP_MD_CTX_free(ctx->md);
+        ctx->md = NULL;
+        return n;
+    }
+
+    // Whole stripes left in the buffer, then the zero-padded remainder;
+    // the length is mixed in below, so padding cannot collide.
+    uint64_t acc[8];
+    memcpy(acc, ctx->acc, sizeof(acc));
+    size_t stripes = ctx->buffered / STRIPE;
+    stripes_scalar(acc, ctx->buf, 0, stripes);
+    size_t rest = ctx->buffered % STRIPE;
+    if (rest) {
+        unsigned char last[STRIPE] = {0};
+        memcpy(last, ctx->buf + stripes * STRIPE, rest);
+        stripes_scalar(acc, last, stripes, 1);
+    }
+
+    uint64_t lo = merge(acc, 3, ctx->total * PRIME64_1);
+    uint64_t hi = merge(acc, 11, ~(ctx->total * PRIME64_2));
+    memcpy(out, &lo, 8);
+    memcpy(out + 8, &hi, 8);
+    return FAST_DIGEST;
+}
+
+size_t hash_buffer(HashAlgo algo, const void *data, size_t len,
+                   unsigned char out[HASH_MAX_DIGEST]) {
+    HashCtx ctx;
+    if (hash_init(&ctx, algo) < 0)
+        return 0;
+    hash_update(&ctx, data, len);
+    return hash_final(&ctx, out);
+}
+
+uint64_t hash64(const void *data, size_t len) {
+    unsigned char d[HASH_MAX_DIGEST];
+    uint64_t h;
+    hash_buffer(HASH_FAST, data, len, d);
+    memcpy(&h, d, 8);
+    return h;
+}
+
+static const char *hash_names[] = {"fast", "sha256"};
+
+const char *hash_name(HashAlgo algo) {
+    return hash_names[algo];
+}
+
+int hash_parse(const char *name, HashAlgo *algo) {
+    for (int i = 0; i < 2; i++) {
+        if (!strcmp(name, hash_names[i])) {
+            *algo = (HashAlgo)i;
+            return 0;
+        }
+    }
+    return -1;
+}
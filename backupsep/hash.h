@@ -0,0 +1,36 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HASH_MAX_DIGEST 32
+#define HASH_BLOCK 1024     // fast hash: 16 stripes of 64 bytes
+
+typedef enum {
+    HASH_FAST,      // in-tree 128-bit multiply-accumulate hash, not secure
+    HASH_SHA256     // OpenSSL EVP, for integrity checks
+} HashAlgo;
+
+typedef struct {
+    HashAlgo algo;
+    void *md;                   // EVP_MD_CTX for HASH_SHA256
+    uint64_t acc[8];
+    unsigned char buf[HASH_BLOCK];
+    size_t buffered;
+    uint64_t total;
+} HashCtx;
+
+int hash_init(HashCtx *ctx, HashAlgo algo);
+void hash_update(HashCtx *ctx, const void *data, size_t len);
+size_t hash_final(HashCtx *ctx, unsigned char out[HASH_MAX_DIGEST]);
+size_t hash_buffer(HashAlgo algo, const void *data, size_t len,
+                   unsigned char out[HASH_MAX_DIGEST]);
+uint64_t hash64(const void *data, size_t len);
+
+const char *hash_name(HashAlgo algo);
+int hash_parse(const char *name, HashAlgo *algo);
+const char *hash_impl(void);
+int hash_select(const char *impl);
+
+#endif
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "intake.h"
+
+// Event intake. One thread reads raw event batches from the change source
+// into a byte ring; the worker decodes and applies them from there, so
+// it can spend seconds on a copy without the kernel queue overflowing
+// meanwhile. Decoding waits for the worker because it needs the watch
+// state as of the events before, which only the worker keeps current.
+//
+// The ring has one producer and one consumer and no lock: head and tail
+// only grow, each is written by one side and published with release
+// stores. Each batch is a Record header followed by the bytes read, both
+// kept RECORD_ALIGN aligned; a header with len 0 pads out the end of the
+// ring. Two eventfds carry the wakeups: data_fd tells the worker's epoll
+// loop there is something to apply, wake_fd tells an intake thread
+// stalled on a full ring that there is room again, or that it is to stop.
+
+#define RECORD_ALIGN 16
+
+typedef struct {
+    uint32_t len;           // bytes read, 0 = skip to the ring's start
+    uint32_t pad;
+    int64_t at_ms;          // when they were read
+} Record;
+
+struct Intake {
+    EventSource *es;
+    WorkerStats *stats;
+    char *ring;
+    size_t cap, read_size;
+    size_t head;            // written by the intake thread
+    size_t tail;            // written by the worker
+    int waiting;            // intake thread is out of room
+    int stop;
+    int data_fd, wake_fd;
+    pthread_t thread;
+};
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t align_up(size_t n) {
+    return (n + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+}
+
+static void signal_fd(int fd) {
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd");
+}
+
+static void clear_fd(int fd) {
+    uint64_t v;
+    if (read(fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        perror("eventfd");
+}
+
+// Sleeps until the change source has events (if want_events) or the
+// worker signals wake_fd.
+static void wait_for(Intake *in, int want_events) {
+    struct pollfd p[2] = {{in->wake_fd, POLLIN, 0},
+                          {events_fd(in->es), POLLIN, 0}};
+    if (poll(p, want_events ? 2 : 1, -1) > 0 && (p[0].revents & POLLIN))
+        clear_fd(in->wake_fd);
+}
+
+static void *intake_main(void *arg) {
+    Intake *in = arg;
+    size_t need = sizeof(Record) + EVENT_BUF_MIN;
+
+    while (!__atomic_load_n(&in->stop, __ATOMIC_ACQUIRE)) {
+        size_t head = in->head;
+        size_t tail = __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE);
+        size_t free_bytes = in->cap - (head - tail);
+        size_t pos = head % in->cap, room = in->cap - pos;
+
+        if (room < need && free_bytes >= room) {
+            // Too little left before the end for a read: pad it out.
+            Record *r = (Record *)(in->ring + pos);
+            r->len = 0;
+            __atomic_store_n(&in->head, head + room, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (free_bytes < need || room < need) {
+            // Full: leave the events in the kernel until the worker
+            // makes room. Re-check after announcing, so a wakeup sent
+            // in between is not missed.
+            __atomic_store_n(&in->waiting, 1, __ATOMIC_SEQ_CST);
+            tail = __atomic_load_n(&in->tail, __ATOMIC_SEQ_CST);
+            if (in->cap - (head - tail) < need &&
+                !__atomic_load_n(&in->stop, __ATOMIC_ACQUIRE))
+                wait_for(in, 0);
+            __atomic_store_n(&in->waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        size_t size = (room < free_bytes ? room : free_bytes) - sizeof(Record);
+        if (size > in->read_size)
+            size = in->read_size;
+        Record *r = (Record *)(in->ring + pos);
+        ssize_t n = events_fetch(in->es, r + 1, size);
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("intake");
+                break;
+            }
+            wait_for(in, 1);
+            continue;
+        }
+        r->len = (uint32_t)n;
+        r->at_ms = now_ms();
+        size_t used = head + sizeof(Record) + align_up((size_t)n) - tail;
+        __atomic_store_n(&in->head, head + sizeof(Record) +
+                         align_up((size_t)n), __ATOMIC_RELEASE);
+        if (in->stats && used > __atomic_load_n(&in->stats->queued_peak,
+                                                 __ATOMIC_RELAXED))
+            __atomic_store_n(&in->stats->queued_peak, used,
+                             __ATOMIC_RELAXED);
+        signal_fd(in->data_fd);
+    }
+    return NULL;
+}
+
+// Starts draining es, read_size bytes at a time, into a ring of
+// ring_size bytes.
+Intake *intake_start(EventSource *es, size_t read_size, size_t ring_size,
+                     WorkerStats *stats) {
+    Intake *in = calloc(1, sizeof(*in));
+    if (!in) return NULL;
+    in->es = es;
+    in->stats = stats;
+    in->read_size = read_size;
+    in->cap = align_up(ring_size);
+    if (in->cap < 2 * (sizeof(Record) + align_up(read_size)))
+        in->cap = 2 * (sizeof(Record) + align_up(read_size));
+    in->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    in->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (in->data_fd < 0 || in->wake_fd < 0 ||
+        posix_memalign((void **)&in->ring, RECORD_ALIGN, in->cap) != 0 ||
+        pthread_create(&in->thread, NULL, intake_main, in) != 0) {
+        perror("intake");
+        if (in->data_fd >= 0) close(in->data_fd);
+        if (in->wake_fd >= 0) close(in->wake_fd);
+        free(in->ring);
+        free(in);
+        return NULL;
+    }
+    return in;
+}
+
+void intake_stop(Intake *in) {
+    if (!in) return;
+    __atomic_store_n(&in->stop, 1, __ATOMIC_RELEASE);
+    signal_fd(in->wake_fd);
+    pthread_join(in->thread, NULL);
+    close(in->data_fd);
+    close(in->wake_fd);
+    free(in->ring);
+    free(in);
+}
+
+// Readable when there are events to drain.
+int intake_fd(const Intake *in) {
+    return in->data_fd;
+}
+
+// Decodes and delivers up to max batches. Returns 1 if more are left,
+// which data_fd will not announce again.
+int intake_drain(Intake *in, int max, EventFn fn, void *arg) {
+    clear_fd(in->data_fd);
+    size_t tail = in->tail;
+    for (int i = 0; i < max; i++) {
+        size_t head = __atomic_load_n(&in->head, __ATOMIC_ACQUIRE);
+        if (tail == head)
+            break;
+        size_t pos = tail % in->cap;
+        Record *r = (Record *)(in->ring + pos);
+        if (r->len == 0) {
+            tail += in->cap - pos;
+        } else {
+            int64_t lag = now_ms() - r->at_ms;
+            events_parse(in->es, r + 1, r->len, fn, arg);
+            tail += sizeof(Record) + align_up(r->len);
+            if (in->stats) {
+                __atomic_store_n(&in->stats->lag_ms, (unsigned long)lag,
+                                 __ATOMIC_RELAXED);
+                if ((unsigned long)lag > in->stats->lag_max_ms)
+                    __atomic_store_n(&in->stats->lag_max_ms,
+                                     (unsigned long)lag, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_store_n(&in->tail, tail, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&in->waiting, __ATOMIC_SEQ_CST))
+            signal_fd(in->wake_fd);
+    }
+    size_t head = __atomic_load_n(&in->head, __ATOMIC_ACQUIRE);
+    if (in->stats)
+        __atomic_store_n(&in->stats->queued, head - tail, __ATOMIC_RELAXED);
+    return head != tail;
+}
@@ -0,0 +1,17 @@
+#ifndef INTAKE_H
+#define INTAKE_H
+
+#include "events.h"
+#include "stats.h"
+
+// A thread that keeps the kernel's event queue drained into a ring the
+// worker applies from at its own pace.
+typedef struct Intake Intake;
+
+Intake *intake_start(EventSource *es, size_t read_size, size_t ring_size,
+                     WorkerStats *stats);
+void intake_stop(Intake *in);
+int intake_fd(const Intake *in);
+int intake_drain(Intake *in, int max, EventFn fn, void *arg);
+
+#endif
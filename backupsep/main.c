@@ -5,11 +5,20 @@
 #include <wordexp.h>
 
 #include "commands.h"
+#include "options.h"
 
 int main(void) {
     char line[1024];
 
-    printf("Commands: add <src> <dst>, end <src> <dst>, list, exit\n");
+    printf("Commands:\n"
+           "  add [options] <src> <dst...>  back up src and keep it in sync\n"
+           "  end <src> <dst...>            stop backing up src\n"
+           "  restore [-p] <src> <dst>      copy a backup dst back to src,\n"
+           "                                -p compares contents\n"
+           "  verify <src> <dst>            check a backup against its manifest\n"
+           "  list                          show running backups\n"
+           "  exit\n"
+           "Run add without arguments for its options.\n");
 
     while (1) {
         printf("> ");
@@ -36,11 +45,15 @@ int main(void) {
         int argc = p.we_wordc;
 
         if (!strcmp(argv[0], "add")) {
-            if (argc >= 3) {
-                for (int i = 2; i < argc; i++)
-                    cmd_add(argv[1], argv[i]);
+            BackupOptions opt;
+            options_init(&opt);
+            int first = parse_options(argc, argv, &opt);
+            if (first > 0 && argc - first >= 2) {
+                for (int i = first + 1; i < argc; i++)
+                    cmd_add(argv[first], argv[i], &opt);
             } else {
-                printf("Usage: add <src> <target...>\n");
+                printf("Usage: add [options] <src> <target...>\n");
+                options_usage();
             }
         }
         else if (!strcmp(argv[0], "end")) {
@@ -52,10 +65,18 @@ int main(void) {
             }
         }
         else if (!strcmp(argv[0], "restore")) {
+            // -p compares contents instead of trusting size and mtime.
+            int paranoid = argc == 4 && !strcmp(argv[1], "-p");
+            if (argc == 3 + paranoid)
+                cmd_restore(argv[1 + paranoid], argv[2 + paranoid], paranoid);
+            else
+                printf("Usage: restore [-p] <src> <target>\n");
+        }
+        else if (!strcmp(argv[0], "verify")) {
             if (argc == 3)
-                cmd_restore(argv[1], argv[2]);
+                cmd_verify(argv[1], argv[2]);
             else
-                printf("Usage: restore <src> <target>\n");
+                printf("Usage: verify <src> <target>\n");
         }
         else if (!strcmp(argv[0], "list")) {
             cmd_list();
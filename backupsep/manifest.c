@@ -0,0 +1,959 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include "manifest.h"
+#include "merkle.h"
+
+// Persistent index of replicated files in TARGET/META_DIR/manifest. The
+// file is an open-addressing hash table keyed by the path below the
+// target root, followed by a heap holding the paths, and is mapped shared
+// so updates reach it without write calls. Once the table is 70% used or
+// the heap is full it is rebuilt into a fresh file of twice the size and
+// renamed over the old one. Every update holds an exclusive flock, so
+// readers in other processes (restore, verify) can copy a consistent
+// snapshot under a shared one.
+
+#define MANIFEST_FILE "manifest"
+#define CHUNKS_DIR "chunks"
+#define MANIFEST_MAGIC "BKMANIF1"
+#define MANIFEST_VERSION 1
+#define INITIAL_SLOTS 1024
+#define INITIAL_HEAP (64 << 10)
+#define HASHER_BUF (256 << 10)
+#define HASHER_IDLE_MS 500
+#define HASHER_SCAN 4096    // slots examined per lock hold
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;     // sizeof(Slot), catches layout changes
+    uint64_t nslots;        // power of two
+    uint64_t used;          // live and dead slots
+    uint64_t live;
+    uint64_t heap_used;
+    uint64_t heap_cap;
+} Header;
+
+enum { SLOT_EMPTY, SLOT_LIVE, SLOT_DEAD };
+
+typedef struct {
+    uint64_t key;           // hash of the path, never 0
+    uint32_t path_off;      // into the heap
+    uint16_t path_len;
+    uint8_t state;
+    uint8_t pad;
+    ManifestEntry e;
+} Slot;
+
+typedef struct {
+    unsigned char *base;
+    size_t len;
+    Header *h;
+    Slot *slots;
+    char *heap;
+} Table;
+
+struct ManifestView {
+    Table t;
+};
+
+static size_t table_bytes(uint64_t nslots, uint64_t heap_cap) {
+    return sizeof(Header) + nslots * sizeof(Slot) + heap_cap;
+}
+
+static int table_bind(Table *t, void *base, size_t len) {
+    t->base = base;
+    t->len = len;
+    t->h = base;
+    if (len < sizeof(Header) ||
+        memcmp(t->h->magic, MANIFEST_MAGIC, 8) ||
+        t->h->version != MANIFEST_VERSION ||
+        t->h->slot_size != sizeof(Slot))
+        return -1;
+
+    uint64_t n = t->h->nslots;
+    if (n == 0 || (n & (n - 1)) || t->h->heap_used > t->h->heap_cap ||
+        t->h->heap_cap > UINT32_MAX || table_bytes(n, t->h->heap_cap) > len)
+        return -1;
+    t->slots = (Slot *)(t->h + 1);
+    t->heap = (char *)(t->slots + n);
+    return 0;
+}
+
+static uint64_t path_key(const char *rel, size_t len) {
+    uint64_t k = hash64(rel, len);
+    return k ? k : 1;
+}
+
+// Index of the slot holding rel, or -1; *insert then gets the slot a new
+// entry for rel should take.
+static long table_find(const Table *t, const char *rel, size_t len,
+                       uint64_t key, long *insert) {
+    uint64_t mask = t->h->nslots - 1;
+    long dead = -1;
+    for (uint64_t i = key & mask, n = 0; n <= mask; i = (i + 1) & mask, n++) {
+        const Slot *s = &t->slots[i];
+        if (s->state == SLOT_EMPTY) {
+            if (insert) *insert = dead >= 0 ? dead : (long)i;
+            return -1;
+        }
+        if (s->state == SLOT_DEAD) {
+            if (dead < 0) dead = (long)i;
+            continue;
+        }
+        if (s->key == key && s->path_len == len &&
+            s->path_off + len <= t->h->heap_cap &&
+            !memcmp(t->heap + s->path_off, rel, len))
+            return (long)i;
+    }
+    if (insert) *insert = dead;
+    return -1;
+}
+
+static Slot *table_insert(Table *t, long i, const char *rel, size_t len,
+                          uint64_t key) {
+    Slot *s = &t->slots[i];
+    if (s->state == SLOT_EMPTY)
+        t->h->used++;
+    t->h->live++;
+    memcpy(t->heap + t->h->heap_used, rel, len);
+    memset(s, 0, sizeof(*s));
+    s->key = key;
+    s->path_off = (uint32_t)t->h->heap_used;
+    s->path_len = (uint16_t)len;
+    s->state = SLOT_LIVE;
+    t->h->heap_used += len;
+    return s;
+}
+
+static int64_t ts_ns(struct timespec ts) {
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int manifest_entry_matches(const ManifestEntry *e, const struct stat *st) {
+    return e->ino == (uint64_t)st->st_ino && e->size == st->st_size &&
+           e->mtime_ns == ts_ns(st->st_mtim);
+}
+
+static int manifest_path(const char *target, const char *name, char *out) {
+    int n = snprintf(out, PATH_MAX, "%s/%s/%s", target, META_DIR, name);
+    return n < 0 || n >= PATH_MAX ? -1 : 0;
+}
+
+// Sidecar with the chunk digests of a large file, named by path key.
+int manifest_chunks_path(const char *target, const char *rel, char *out) {
+    char name[64];
+    snprintf(name, sizeof(name), CHUNKS_DIR "/%016llx",
+             (unsigned long long)path_key(rel, strlen(rel)));
+    return manifest_path(target, name, out);
+}
+
+int manifest_exists(const char *target) {
+    char path[PATH_MAX];
+    return manifest_path(target, MANIFEST_FILE, path) == 0 &&
+           access(path, F_OK) == 0;
+}
+
+// ---- Writer ----
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int mfd = -1;
+static Table table;
+static char root[PATH_MAX];
+static size_t root_len;
+static char file_path[PATH_MAX];
+static HashAlgo hash_algo;
+static int fused_hash;          // copies hash what they write
+
+static pthread_t hasher;
+static int hasher_running;
+static int hasher_stop;
+static unsigned long changes;   // bumped whenever an entry loses its digest
+
+// ---- Directory index ----
+
+// The live entries by directory, kept in memory beside the mapped table
+// and rebuilt along with it, so removing or renaming a directory visits
+// only the entries below it instead of every slot. Should it run out of
+// memory, tree operations go back to scanning the table.
+
+typedef struct Dir {
+    struct Dir *next;                   // hash chain
+    struct Dir *parent, *child;         // child: first subdirectory
+    struct Dir *prev, *sibling;         // among the parent's children
+    long files;             // first slot of the entries in it, or -1
+    size_t len;
+    char path[];            // below the root, "" for the root itself
+} Dir;
+
+static Dir **dirs;
+static size_t dir_buckets, ndirs;
+static long *file_next, *file_prev;     // per slot, within its Dir
+static Dir **file_dir;
+static int indexed;
+
+static size_t dir_bucket(const char *path, size_t len) {
+    return hash64(path, len) & (dir_buckets - 1);
+}
+
+// Length of the directory part of path.
+static size_t parent_len(const char *path, size_t len) {
+    size_t n = len ? len - 1 : 0;
+    while (n > 0 && path[n] != '/')
+        n--;
+    return n;
+}
+
+static Dir *dir_find(const char *path, size_t len) {
+    if (!dir_buckets) return NULL;
+    Dir *d = dirs[dir_bucket(path, len)];
+    while (d && (d->len != len || memcmp(d->path, path, len)))
+        d = d->next;
+    return d;
+}
+
+static int dirs_grow(void) {
+    size_t n = dir_buckets ? dir_buckets * 2 : 1024;
+    Dir **b = calloc(n, sizeof(*b));
+    if (!b) return -1;
+    for (size_t i = 0; i < dir_buckets; i++) {
+        for (Dir *d = dirs[i], *next; d; d = next) {
+            next = d->next;
+            size_t k = hash64(d->path, d->len) & (n - 1);
+            d->next = b[k];
+            b[k] = d;
+        }
+    }
+    free(dirs);
+    dirs = b;
+    dir_buckets = n;
+    return 0;
+}
+
+// The directory at path, made along with its parents if need be.
+static Dir *dir_get(const char *path, size_t len) {
+    Dir *d = dir_find(path, len), *parent = NULL;
+    if (d) return d;
+    if (len > 0 && !(parent = dir_get(path, parent_len(path, len))))
+        return NULL;
+    if ((ndirs >= dir_buckets && dirs_grow() < 0) ||
+        !(d = calloc(1, sizeof(*d) + len + 1)))
+        return NULL;
+    memcpy(d->path, path, len);
+    d->len = len;
+    d->files = -1;
+    d->parent = parent;
+    if (parent) {
+        d->sibling = parent->child;
+        if (parent->child) parent->child->prev = d;
+        parent->child = d;
+    }
+    size_t k = dir_bucket(path, len);
+    d->next = dirs[k];
+    dirs[k] = d;
+    ndirs++;
+    return d;
+}
+
+// Frees d and then each parent it leaves empty.
+static void dir_prune(Dir *d) {
+    while (d && d->parent && d->files < 0 && !d->child) {
+        Dir *parent = d->parent;
+        if (d->prev) d->prev->sibling = d->sibling;
+        else parent->child = d->sibling;
+        if (d->sibling) d->sibling->prev = d->prev;
+        Dir **pp = &dirs[dir_bucket(d->path, d->len)];
+        while (*pp != d)
+            pp = &(*pp)->next;
+        *pp = d->next;
+        ndirs--;
+        free(d);
+        d = parent;
+    }
+}
+
+static void index_drop(void) {
+    for (size_t i = 0; i < dir_buckets; i++) {
+        for (Dir *d = dirs[i], *next; d; d = next) {
+            next = d->next;
+            free(d);
+        }
+    }
+    free(dirs);
+    free(file_next);
+    free(file_prev);
+    free(file_dir);
+    dirs = NULL;
+    file_next = file_prev = NULL;
+    file_dir = NULL;
+    dir_buckets = ndirs = 0;
+    indexed = 0;
+}
+
+static void index_add(long i) {
+    if (!indexed) return;
+    const Slot *s = &table.slots[i];
+    const char *path = table.heap + s->path_off;
+    Dir *d = dir_get(path, parent_len(path, s->path_len));
+    if (!d) {
+        index_drop();
+        return;
+    }
+    file_dir[i] = d;
+    file_prev[i] = -1;
+    file_next[i] = d->files;
+    if (d->files >= 0)
+        file_prev[d->files] = i;
+    d->files = i;
+}
+
+static void index_remove(long i) {
+    Dir *d;
+    if (!indexed || !(d = file_dir[i])) return;
+    if (file_prev[i] >= 0) file_next[file_prev[i]] = file_next[i];
+    else d->files = file_next[i];
+    if (file_next[i] >= 0) file_prev[file_next[i]] = file_prev[i];
+    file_dir[i] = NULL;
+    dir_prune(d);
+}
+
+// Indexes every live slot of the table. Caller holds the lock.
+static void index_build(void) {
+    uint64_t n = table.h->nslots;
+    index_drop();
+    file_next = malloc(n * sizeof(*file_next));
+    file_prev = malloc(n * sizeof(*file_prev));
+    file_dir = calloc(n, sizeof(*file_dir));
+    if (!file_next || !file_prev || !file_dir) {
+        index_drop();
+        return;
+    }
+    indexed = 1;
+    for (uint64_t i = 0; i < n && indexed; i++)
+        if (table.slots[i].state == SLOT_LIVE)
+            index_add((long)i);
+}
+
+static int below(const Slot *s, const char *rel, size_t len) {
+    return s->state == SLOT_LIVE && s->path_len > len &&
+           table.heap[s->path_off + len] == '/' &&
+           !memcmp(table.heap + s->path_off, rel, len);
+}
+
+static int push_slot(long **v, size_t *n, size_t *cap, long i) {
+    if (*n == *cap) {
+        size_t c = *cap ? *cap * 2 : 64;
+        long *p = realloc(*v, c * sizeof(*p));
+        if (!p) return -1;
+        *v = p;
+        *cap = c;
+    }
+    (*v)[(*n)++] = i;
+    return 0;
+}
+
+// The live slots below rel, in a malloc'd array of *n. Caller holds the
+// lock.
+static long *slots_below(const char *rel, size_t *n) {
+    size_t len = strlen(rel), cap = 0;
+    long *v = NULL;
+    *n = 0;
+    if (!indexed) {
+        for (uint64_t i = 0; i < table.h->nslots; i++)
+            if (below(&table.slots[i], rel, len) &&
+                push_slot(&v, n, &cap, (long)i) < 0)
+                break;
+        return v;
+    }
+
+    Dir *top = dir_find(rel, len);
+    for (Dir *d = top; d; ) {
+        for (long f = d->files; f >= 0; f = file_next[f])
+            if (push_slot(&v, n, &cap, f) < 0)
+                return v;
+        if (d->child) {
+            d = d->child;
+            continue;
+        }
+        while (d != top && !d->sibling)
+            d = d->parent;
+        d = d == top ? NULL : d->sibling;
+    }
+    return v;
+}
+
+// Creates an empty table file at path, mapped and exclusively locked.
+static int table_create(const char *path, uint64_t nslots,
+                        uint64_t heap_cap, Table *t) {
+    size_t len = table_bytes(nslots, heap_cap);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    void *base = MAP_FAILED;
+    if (flock(fd, LOCK_EX) < 0 || ftruncate(fd, len) < 0 ||
+        (base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0)) == MAP_FAILED) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    Header *h = base;
+    memcpy(h->magic, MANIFEST_MAGIC, 8);
+    h->version = MANIFEST_VERSION;
+    h->slot_size = sizeof(Slot);
+    h->nslots = nslots;
+    h->heap_cap = heap_cap;
+    table_bind(t, base, len);
+    return fd;
+}
+
+// Moves every live entry into a larger file with room for `need` more
+// bytes of path, then swaps it in. Caller holds the locks.
+static int rebuild(size_t need) {
+    uint64_t nslots = table.h->nslots;
+    while ((table.h->live + 1) * 10 > nslots * 5)
+        nslots *= 2;
+    uint64_t heap_cap = table.h->heap_cap;
+    while (heap_cap < (table.h->heap_used + need) * 2)
+        heap_cap *= 2;
+    if (heap_cap > UINT32_MAX)
+        return -1;
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file_path);
+    Table nt;
+    int fd = table_create(tmp, nslots, heap_cap, &nt);
+    if (fd < 0) {
+        perror(tmp);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < table.h->nslots; i++) {
+        const Slot *s = &table.slots[i];
+        if (s->state != SLOT_LIVE) continue;
+        long at = -1;
+        table_find(&nt, table.heap + s->path_off, s->path_len, s->key, &at);
+        Slot *d = table_insert(&nt, at, table.heap + s->path_off,
+                               s->path_len, s->key);
+        d->e = s->e;
+    }
+
+    if (msync(nt.base, nt.len, MS_SYNC) < 0 || rename(tmp, file_path) < 0) {
+        perror(file_path);
+        munmap(nt.base, nt.len);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    munmap(table.base, table.len);
+    close(mfd);
+    mfd = fd;
+    table = nt;
+    index_build();
+    return 0;
+}
+
+// Locks the manifest for an update; returns 0 if one is open.
+static int begin(void) {
+    pthread_mutex_lock(&lock);
+    if (mfd < 0) {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    flock(mfd, LOCK_EX);
+    return 0;
+}
+
+static void end(void) {
+    flock(mfd, LOCK_UN);
+    pthread_mutex_unlock(&lock);
+}
+
+static Slot *slot_for(const char *rel, int create) {
+    size_t len = strlen(rel);
+    uint64_t key = path_key(rel, len);
+    long at = -1;
+    long i = table_find(&table, rel, len, key, &at);
+    if (i >= 0) return &table.slots[i];
+    if (!create) return NULL;
+
+    if (at < 0 || (table.h->used + 1) * 10 > table.h->nslots * 7 ||
+        table.h->heap_used + len > table.h->heap_cap) {
+        if (rebuild(len) < 0) return NULL;
+        table_find(&table, rel, len, key, &at);
+        if (at < 0) return NULL;
+    }
+    Slot *s = table_insert(&table, at, rel, len, key);
+    index_add(at);
+    return s;
+}
+
+// Path of dst below the target root, or NULL if it is not below it.
+static const char *rel_path(const char *dst) {
+    if (strncmp(dst, root, root_len) || dst[root_len] != '/')
+        return NULL;
+    return dst + root_len;
+}
+
+int manifest_open(const char *target, HashAlgo algo, int fused) {
+    char dir[PATH_MAX];
+    int n = snprintf(dir, sizeof(dir), "%s/%s", target, META_DIR);
+    if (n < 0 || n >= (int)sizeof(dir) ||
+        strlen(target) >= sizeof(root) ||
+        manifest_path(target, MANIFEST_FILE, file_path) < 0)
+        return -1;
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+    char chunks[PATH_MAX];
+    if (manifest_path(target, CHUNKS_DIR, chunks) == 0)
+        mkdir(chunks, 0700);
+
+    pthread_mutex_lock(&lock);
+    strcpy(root, target);
+    root_len = strlen(root);
+    hash_algo = algo;
+    fused_hash = fused;
+
+    // Reuse an intact manifest; anything else is started over.
+    int fd = open(file_path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+        base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    fd, 0);
+    if (base != MAP_FAILED && table_bind(&table, base, st.st_size) == 0) {
+        mfd = fd;
+    } else {
+        if (base != MAP_FAILED) munmap(base, st.st_size);
+        if (fd >= 0) close(fd);
+        mfd = table_create(file_path, INITIAL_SLOTS, INITIAL_HEAP, &table);
+        if (mfd >= 0)
+            flock(mfd, LOCK_UN);
+        else
+            perror(file_path);
+    }
+    if (mfd >= 0)
+        index_build();
+    pthread_mutex_unlock(&lock);
+    return mfd < 0 ? -1 : 0;
+}
+
+void manifest_close(void) {
+    if (hasher_running) {
+        __atomic_store_n(&hasher_stop, 1, __ATOMIC_RELAXED);
+        pthread_join(hasher, NULL);
+        hasher_running = 0;
+    }
+    pthread_mutex_lock(&lock);
+    if (mfd >= 0) {
+        msync(table.base, table.len, MS_SYNC);
+        munmap(table.base, table.len);
+        close(mfd);
+        mfd = -1;
+    }
+    index_drop();
+    pthread_mutex_unlock(&lock);
+}
+
+// The algorithm copies should hash with, or 0 if they need not bother.
+int manifest_copy_algo(HashAlgo *algo) {
+    if (mfd < 0 || !fused_hash)
+        return 0;
+    *algo = hash_algo;
+    return 1;
+}
+
+// A digest computed while copying stands for dst only if the size still
+// matches, and only large files need their chunks written out first.
+static int digest_usable(const char *rel, const struct stat *st,
+                         FileDigest *d) {
+    char side[PATH_MAX];
+    if (!d || !d->len || d->algo != hash_algo || d->size != st->st_size)
+        return 0;
+    if (!d->tree.chunks)
+        return 1;
+    d->tree.ino = st->st_ino;
+    d->tree.mtime_ns = ts_ns(st->st_mtim);
+    return manifest_chunks_path(root, rel, side) == 0 &&
+           merkle_save(side, &d->tree) == 0;
+}
+
+static void record(const char *dst, FileDigest *d) {
+    const char *rel = rel_path(dst);
+    struct stat st;
+    if (mfd < 0 || !rel || lstat(dst, &st) < 0)
+        return;
+    if (!S_ISREG(st.st_mode)) {
+        manifest_forget(dst, 0);
+        return;
+    }
+    int have = digest_usable(rel, &st, d);
+
+    if (begin() < 0) return;
+    Slot *s = slot_for(rel, 1);
+    if (s) {
+        if (have) {
+            memcpy(s->e.hash, d->digest, d->len);
+            s->e.hash_len = (uint8_t)d->len;
+            s->e.hash_algo = (uint8_t)d->algo;
+        } else if (!manifest_entry_matches(&s->e, &st) || !s->e.hash_len) {
+            s->e.hash_len = 0;
+            __atomic_add_fetch(&changes, 1, __ATOMIC_RELAXED);
+        }
+        s->e.ino = st.st_ino;
+        s->e.size = st.st_size;
+        s->e.mtime_ns = ts_ns(st.st_mtim);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        s->e.replicated_ns = ts_ns(now);
+    }
+    end();
+}
+
+// Notes that dst was just written. The digest is kept only if the file
+// is still exactly what was hashed.
+void manifest_record(const char *dst) {
+    record(dst, NULL);
+}
+
+// As manifest_record, taking the digest the copy computed over the bytes
+// it wrote, so the hasher never has to read dst back.
+void manifest_record_digest(const char *dst, FileDigest *d) {
+    record(dst, d);
+}
+
+void manifest_record_hash(const char *dst, const struct stat *st,
+                          HashAlgo algo, const unsigned char *hash,
+                          size_t len) {
+    const char *rel = rel_path(dst);
+    if (!rel || len > HASH_MAX_DIGEST || begin() < 0)
+        return;
+    Slot *s = slot_for(rel, 0);
+    if (s && manifest_entry_matches(&s->e, st)) {
+        memcpy(s->e.hash, hash, len);
+        s->e.hash_len = (uint8_t)len;
+        s->e.hash_algo = (uint8_t)algo;
+    }
+    end();
+}
+
+static void kill_slot(Slot *s) {
+    if (s->e.size >= MERKLE_MIN) {
+        char rel[PATH_MAX], path[PATH_MAX];
+        memcpy(rel, table.heap + s->path_off, s->path_len);
+        rel[s->path_len] = '\0';
+        if (manifest_chunks_path(root, rel, path) == 0)
+            unlink(path);
+    }
+    s->state = SLOT_DEAD;
+    table.h->live--;
+    index_remove((long)(s - table.slots));
+}
+
+// Caller holds the locks.
+static void forget_locked(const char *rel, int tree) {
+    Slot *s = slot_for(rel, 0);
+    if (s)
+        kill_slot(s);
+    if (!tree)
+        return;
+
+    size_t n;
+    long *v = slots_below(rel, &n);
+    for (size_t i = 0; i < n; i++)
+        kill_slot(&table.slots[v[i]]);
+    free(v);
+}
+
+// Drops dst and, with tree set, everything below it.
+void manifest_forget(const char *dst, int tree) {
+    const char *rel = rel_path(dst);
+    if (mfd < 0 || !rel || begin() < 0)
+        return;
+    forget_locked(rel, tree);
+    end();
+}
+
+// Re-files one entry under a new path, sidecar included. Caller holds
+// the locks.
+static void move_entry(const char *from, const char *to) {
+    Slot *s = slot_for(from, 0);
+    if (!s) return;
+    ManifestEntry e = s->e;
+    s->state = SLOT_DEAD;
+    table.h->live--;
+    index_remove((long)(s - table.slots));
+
+    if (e.size >= MERKLE_MIN) {
+        char a[PATH_MAX], b[PATH_MAX];
+        if (manifest_chunks_path(root, from, a) == 0 &&
+            manifest_chunks_path(root, to, b) == 0)
+            rename(a, b);
+    }
+    Slot *d = slot_for(to, 1);
+    if (d)
+        d->e = e;
+}
+
+// Follows a rename in the target: the entries for from (and, with tree
+// set, everything below it) move to to, keeping their digests. Whatever
+// to held before is dropped.
+void manifest_move(const char *from, const char *to, int tree) {
+    const char *rf = rel_path(from), *rt = rel_path(to);
+    if (mfd < 0 || !rf || !rt || begin() < 0)
+        return;
+    forget_locked(rt, tree);
+
+    // Collect the paths first: inserting may rebuild the table.
+    size_t len = strlen(rf), n = 0;
+    long *v = tree ? slots_below(rf, &n) : NULL;
+    char **paths = n ? malloc(n * sizeof(*paths)) : NULL;
+    for (size_t i = 0; i < n; i++) {
+        const Slot *s = &table.slots[v[i]];
+        if (!paths ||
+            !(paths[i] = strndup(table.heap + s->path_off, s->path_len))) {
+            n = i;
+            break;
+        }
+    }
+    free(v);
+
+    char moved[PATH_MAX];
+    move_entry(rf, rt);
+    for (size_t i = 0; i < n; i++) {
+        int k = snprintf(moved, sizeof(moved), "%s%s", rt, paths[i] + len);
+        if (k > 0 && k < (int)sizeof(moved))
+            move_entry(paths[i], moved);
+        free(paths[i]);
+    }
+    free(paths);
+    end();
+}
+
+// Whether the manifest already has src's size and mtime for dst, and
+// dst is still the file it describes, so the copy can be skipped.
+int manifest_current(const char *src, const char *dst) {
+    const char *rel = rel_path(dst);
+    struct stat st, dt;
+    if (mfd < 0 || !rel || lstat(src, &st) < 0 || !S_ISREG(st.st_mode) ||
+        lstat(dst, &dt) < 0 || !S_ISREG(dt.st_mode))
+        return 0;
+
+    int current = 0;
+    pthread_mutex_lock(&lock);
+    if (mfd >= 0) {
+        Slot *s = slot_for(rel, 0);
+        current = s && s->e.size == st.st_size &&
+                  s->e.mtime_ns == ts_ns(st.st_mtim) &&
+                  manifest_entry_matches(&s->e, &dt);
+    }
+    pthread_mutex_unlock(&lock);
+    return current;
+}
+
+// ---- Background hasher ----
+
+static int stopping(void) {
+    return __atomic_load_n(&hasher_stop, __ATOMIC_RELAXED);
+}
+
+// Copies out the next entry from *cursor on that lacks a digest in the
+// configured algorithm. At most HASHER_SCAN of the *left slots still to
+// be examined are looked at per call.
+static int next_unhashed(uint64_t *cursor, uint64_t *left, char *rel,
+                         ManifestEntry *e) {
+    int found = 0;
+    pthread_mutex_lock(&lock);
+    uint64_t n = mfd >= 0 ? table.h->nslots : 0;
+    if (*left > n) *left = n;
+    for (int k = 0; k < HASHER_SCAN && *left > 0 && !found; k++) {
+        const Slot *s = &table.slots[(*cursor)++ & (n - 1)];
+        (*left)--;
+        if (s->state != SLOT_LIVE ||
+            (s->e.hash_len && s->e.hash_algo == hash_algo))
+            continue;
+        memcpy(rel, table.heap + s->path_off, s->path_len);
+        rel[s->path_len] = '\0';
+        *e = s->e;
+        found = 1;
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+static void hash_one(const char *rel, const ManifestEntry *e, char *buf) {
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s%s", root, rel);
+    if (n < 0 || n >= (int)sizeof(path))
+        return;
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat before, after;
+    if (fstat(fd, &before) < 0 || !manifest_entry_matches(e, &before)) {
+        close(fd);
+        return;
+    }
+
+    // Large files get a tree hash, hashed on all cores, with the chunk
+    // digests kept in a sidecar; the rest are hashed linearly.
+    unsigned char digest[HASH_MAX_DIGEST];
+    size_t len = 0;
+    MerkleTree tree = {0};
+    if (before.st_size >= MERKLE_MIN) {
+        if (merkle_build(fd, hash_algo, &hasher_stop, &tree) == 0) {
+            len = tree.digest_len;
+            memcpy(digest, tree.root, len);
+        }
+    } else {
+        HashCtx ctx;
+        ssize_t got = -1;
+        if (hash_init(&ctx, hash_algo) == 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            while (!stopping() && (got = read(fd, buf, HASHER_BUF)) > 0)
+                hash_update(&ctx, buf, got);
+            len = hash_final(&ctx, digest);
+        }
+        if (got != 0) len = 0;
+    }
+
+    // A write during the read changes ctime, which futimens cannot undo.
+    if (len && !stopping() && fstat(fd, &after) == 0 &&
+        ts_ns(after.st_ctim) == ts_ns(before.st_ctim) &&
+        manifest_entry_matches(e, &after)) {
+        char side[PATH_MAX];
+        if (!tree.chunks ||
+            (manifest_chunks_path(root, rel, side) == 0 &&
+             merkle_save(side, &tree) == 0))
+            manifest_record_hash(path, &after, hash_algo, digest, len);
+    }
+    merkle_free(&tree);
+
+    // Do not leave the backup in the page cache.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static void *hasher_main(void *arg) {
+    (void)arg;
+    // Idle CPU and I/O priority for this thread only.
+    pid_t tid = (pid_t)syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, tid,
+            3 << 13 /* IOPRIO_CLASS_IDLE */);
+
+    char *buf = malloc(HASHER_BUF);
+    char rel[PATH_MAX];
+    uint64_t cursor = 0, left = 0;
+    unsigned long seen = 0;
+    ManifestEntry e;
+    while (buf && !stopping()) {
+        // Sweep the whole table again only after something changed.
+        unsigned long now = __atomic_load_n(&changes, __ATOMIC_RELAXED);
+        if (now != seen) {
+            seen = now;
+            left = UINT64_MAX;
+        }
+        if (left > 0) {
+            if (next_unhashed(&cursor, &left, rel, &e))
+                hash_one(rel, &e, buf);
+            continue;
+        }
+        struct timespec ts = {0, 100 * 1000000L};
+        for (int i = 0; i < HASHER_IDLE_MS / 100 && !stopping(); i++)
+            nanosleep(&ts, NULL);
+    }
+    free(buf);
+    return NULL;
+}
+
+void manifest_start_hasher(void) {
+    if (mfd < 0 || hasher_running) return;
+    hasher_stop = 0;
+    changes++;  // one initial sweep
+    if (pthread_create(&hasher, NULL, hasher_main, NULL) == 0)
+        hasher_running = 1;
+}
+
+// ---- Reader ----
+
+// Copies the manifest under a shared lock. Retries if a rebuild renamed
+// a new file into place between open and lock.
+ManifestView *manifest_load(const char *target) {
+    char path[PATH_MAX];
+    if (manifest_path(target, MANIFEST_FILE, path) < 0)
+        return NULL;
+
+    for (int attempt = 0; attempt < 3; attempt++) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return NULL;
+        struct stat st, cur;
+        if (flock(fd, LOCK_SH) < 0 || fstat(fd, &st) < 0) {
+            close(fd);
+            return NULL;
+        }
+        if (stat(path, &cur) < 0 || cur.st_ino != st.st_ino) {
+            close(fd);
+            continue;
+        }
+
+        ManifestView *v = malloc(sizeof(*v));
+        unsigned char *buf = malloc(st.st_size ? st.st_size : 1);
+        size_t done = 0;
+        while (v && buf && done < (size_t)st.st_size) {
+            ssize_t n = pread(fd, buf + done, st.st_size - done, done);
+            if (n <= 0) break;
+            done += n;
+        }
+        close(fd);
+        if (v && buf && done == (size_t)st.st_size &&
+            table_bind(&v->t, buf, done) == 0)
+            return v;
+        free(buf);
+        free(v);
+        return NULL;
+    }
+    return NULL;
+}
+
+int manifest_find(const ManifestView *v, const char *rel,
+                  ManifestEntry *out) {
+    size_t len = strlen(rel);
+    long i = table_find(&v->t, rel, len, path_key(rel, len), NULL);
+    if (i < 0) return -1;
+    *out = v->t.slots[i].e;
+    return 0;
+}
+
+void manifest_each(const ManifestView *v, ManifestFn fn, void *arg) {
+    char rel[PATH_MAX];
+    for (uint64_t i = 0; i < v->t.h->nslots; i++) {
+        const Slot *s = &v->t.slots[i];
+        if (s->state != SLOT_LIVE || s->path_len >= sizeof(rel) ||
+            s->path_off + s->path_len > v->t.h->heap_cap)
+            continue;
+        memcpy(rel, v->t.heap + s->path_off, s->path_len);
+        rel[s->path_len] = '\0';
+        fn(rel, &s->e, arg);
+    }
+}
+
+void manifest_view_free(ManifestView *v) {
+    if (!v) return;
+    free(v->t.base);
+    free(v);
+}
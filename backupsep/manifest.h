@@ -0,0 +1,53 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "hash.h"
+#include "merkle.h"
+
+// Reserved directory in every target; tree walks over a target skip it.
+#define META_DIR ".backup-meta"
+
+// What the manifest knows about one replicated file. mtime is the
+// target's, which matches the source's since metadata is replicated.
+typedef struct {
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t replicated_ns;      // wall clock of the last write
+    uint8_t hash_algo;          // HashAlgo
+    uint8_t hash_len;           // 0 until the file has been hashed
+    unsigned char hash[HASH_MAX_DIGEST];
+} ManifestEntry;
+
+// Worker side: one open manifest per process, updated as files are
+// written. All calls are no-ops while no manifest is open.
+int manifest_open(const char *target, HashAlgo algo, int fused);
+void manifest_close(void);
+int manifest_copy_algo(HashAlgo *algo);
+void manifest_record(const char *dst);
+void manifest_record_digest(const char *dst, FileDigest *d);
+void manifest_record_hash(const char *dst, const struct stat *st,
+                          HashAlgo algo, const unsigned char *hash,
+                          size_t len);
+void manifest_forget(const char *dst, int tree);
+void manifest_move(const char *from, const char *to, int tree);
+int manifest_current(const char *src, const char *dst);
+void manifest_start_hasher(void);
+
+// Reader side: a private snapshot, for restore and verify.
+typedef struct ManifestView ManifestView;
+typedef void (*ManifestFn)(const char *rel, const ManifestEntry *e,
+                           void *arg);
+
+ManifestView *manifest_load(const char *target);
+int manifest_find(const ManifestView *v, const char *rel,
+                  ManifestEntry *out);
+void manifest_each(const ManifestView *v, ManifestFn fn, void *arg);
+void manifest_view_free(ManifestView *v);
+int manifest_exists(const char *target);
+int manifest_chunks_path(const char *target, const char *rel, char *out);
+int manifest_entry_matches(const ManifestEntry *e, const struct stat *st);
+
+#endif
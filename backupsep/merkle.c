@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <pthread.h>
+#include "merkle.h"
+
+// Tree hashing for large files. The file is cut into MERKLE_CHUNK pieces
+// that a short-lived pool of threads reads and hashes independently, so
+// one big file can use every core. Leaves are H(0 || chunk), inner nodes
+// H(1 || left || right) with an odd node carried up unchanged, and the
+// root is H(2 || size || top). The leaf digests can be saved next to the
+// backup so a later comparison only needs to hash the other side and can
+// tell which chunks differ.
+
+#define MERKLE_THREADS 16
+#define MERKLE_MAGIC "BKCHUNK1"
+
+typedef struct {
+    int fd;
+    MerkleTree *t;
+    const int *cancel;
+    uint64_t next;      // next chunk to claim
+    int failed;
+} Job;
+
+static int cancelled(const Job *j) {
+    return (j->cancel && __atomic_load_n(j->cancel, __ATOMIC_RELAXED)) ||
+           __atomic_load_n(&j->failed, __ATOMIC_RELAXED);
+}
+
+static int leaf_init(HashCtx *ctx, HashAlgo algo) {
+    unsigned char tag = 0;
+    if (hash_init(ctx, algo) < 0)
+        return -1;
+    hash_update(ctx, &tag, 1);
+    return 0;
+}
+
+static void *chunk_worker(void *arg) {
+    Job *j = arg;
+    MerkleTree *t = j->t;
+    char *buf = malloc(MERKLE_CHUNK);
+    if (!buf) {
+        __atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    while (!cancelled(j)) {
+        uint64_t i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED);
+        if (i >= t->nchunks) break;
+
+        off_t off = (off_t)i * MERKLE_CHUNK;
+        size_t want = t->size - off < MERKLE_CHUNK ? t->size - off
+                                                   : MERKLE_CHUNK;
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = pread(j->fd, buf + got, want - got, off + got);
+            if (n <= 0) break;
+            got += n;
+        }
+        if (got < want) {
+            __atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        HashCtx ctx;
+        if (leaf_init(&ctx, t->algo) < 0) {
+            __atomic_store_n(&j->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        hash_update(&ctx, buf, got);
+        hash_final(&ctx, t->chunks + i * t->digest_len);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int compute_root(MerkleTree *t) {
+    size_t d = t->digest_len;
+    uint64_t n = t->nchunks;
+    unsigned char *level = malloc(n ? n * d : d);
+    if (!level) return -1;
+    memcpy(level, t->chunks, n * d);
+
+    while (n > 1) {
+        uint64_t m = 0;
+        for (uint64_t i = 0; i < n; i += 2, m++) {
+            if (i + 1 == n) {
+                memmove(level + m * d, level + i * d, d);
+                continue;
+            }
+            HashCtx ctx;
+            unsigned char tag = 1;
+            if (hash_init(&ctx, t->algo) < 0) {
+                free(level);
+                return -1;
+            }
+            hash_update(&ctx, &tag, 1);
+            hash_update(&ctx, level + i * d, 2 * d);
+            hash_final(&ctx, level + m * d);
+        }
+        n = m;
+    }
+
+    HashCtx ctx;
+    unsigned char tag = 2;
+    uint64_t size = t->size;
+    if (hash_init(&ctx, t->algo) < 0) {
+        free(level);
+        return -1;
+    }
+    hash_update(&ctx, &tag, 1);
+    hash_update(&ctx, &size, sizeof(size));
+    hash_update(&ctx, level, t->nchunks ? d : 0);
+    hash_final(&ctx, t->root);
+    free(level);
+    return 0;
+}
+
+static int tree_init(MerkleTree *t, HashAlgo algo, long long size) {
+    unsigned char probe[HASH_MAX_DIGEST];
+    memset(t, 0, sizeof(*t));
+    t->algo = algo;
+    t->digest_len = hash_buffer(algo, "", 0, probe);
+    t->size = size;
+    t->nchunks = (size + MERKLE_CHUNK - 1) / MERKLE_CHUNK;
+    if (!t->digest_len ||
+        !(t->chunks = malloc(t->nchunks ? t->nchunks * t->digest_len : 1)))
+        return -1;
+    return 0;
+}
+
+// Hashes the whole of fd. Stops early (returning -1) once *cancel is set.
+int merkle_build(int fd, HashAlgo algo, const int *cancel, MerkleTree *t) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        memset(t, 0, sizeof(*t));
+        return -1;
+    }
+    if (tree_init(t, algo, st.st_size) < 0)
+        return -1;
+    t->ino = st.st_ino;
+    t->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL +
+                  st.st_mtim.tv_nsec;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t threads = cpus > 0 ? (uint64_t)cpus : 1;
+    if (threads > MERKLE_THREADS) threads = MERKLE_THREADS;
+    if (threads > t->nchunks) threads = t->nchunks;
+
+    Job job = {fd, t, cancel, 0, 0};
+    pthread_t tids[MERKLE_THREADS];
+    uint64_t started = 0;
+    for (; started + 1 < threads; started++)
+        if (pthread_create(&tids[started], NULL, chunk_worker, &job) != 0)
+            break;
+    if (t->nchunks)
+        chunk_worker(&job);
+    for (uint64_t i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    if (cancelled(&job) || compute_root(t) < 0) {
+        merkle_free(t);
+        return -1;
+    }
+    return 0;
+}
+
+void merkle_free(MerkleTree *t) {
+    free(t->chunks);
+    t->chunks = NULL;
+}
+
+static int same_chunk(const MerkleTree *a, const MerkleTree *b, uint64_t i) {
+    return a->algo == b->algo && a->digest_len == b->digest_len &&
+           i < a->nchunks && i < b->nchunks &&
+           !memcmp(a->chunks + i * a->digest_len,
+                   b->chunks + i * b->digest_len, a->digest_len);
+}
+
+// Finds the next run of differing chunks at or after `first`. Returns
+// its first chunk and sets *next past its end; returns -1 when there is
+// none. Chunks that exist in only one tree count as different.
+long long merkle_diff(const MerkleTree *a, const MerkleTree *b,
+                      uint64_t first, uint64_t *next) {
+    uint64_t n = a->nchunks > b->nchunks ? a->nchunks : b->nchunks;
+    uint64_t i = first;
+    while (i < n && same_chunk(a, b, i))
+        i++;
+    if (i >= n) return -1;
+
+    uint64_t j = i + 1;
+    while (j < n && !same_chunk(a, b, j))
+        j++;
+    *next = j;
+    return (long long)i;
+}
+
+typedef struct {
+    char magic[8];
+    uint32_t algo;
+    uint32_t digest_len;
+    int64_t size;
+    uint64_t nchunks;
+    uint64_t ino;
+    int64_t mtime_ns;
+    unsigned char root[HASH_MAX_DIGEST];
+} SidecarHeader;
+
+// Written to a temp file and renamed, so a reader never sees half.
+int merkle_save(const char *path, const MerkleTree *t) {
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+
+    SidecarHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MERKLE_MAGIC, 8);
+    h.algo = t->algo;
+    h.digest_len = t->digest_len;
+    h.size = t->size;
+    h.nchunks = t->nchunks;
+    h.ino = t->ino;
+    h.mtime_ns = t->mtime_ns;
+    memcpy(h.root, t->root, sizeof(h.root));
+
+    size_t body = t->nchunks * t->digest_len;
+    int rc = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) &&
+             write(fd, t->chunks, body) == (ssize_t)body ? 0 : -1;
+    if (close(fd) < 0) rc = -1;
+    if (rc == 0 && rename(tmp, path) < 0) rc = -1;
+    if (rc < 0) unlink(tmp);
+    return rc;
+}
+
+int merkle_load(const char *path, MerkleTree *t) {
+    memset(t, 0, sizeof(*t));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    SidecarHeader h;
+    int rc = -1;
+    if (read(fd, &h, sizeof(h)) != (ssize_t)sizeof(h) ||
+        memcmp(h.magic, MERKLE_MAGIC, 8) ||
+        h.digest_len == 0 || h.digest_len > HASH_MAX_DIGEST || h.size < 0 ||
+        h.nchunks != (uint64_t)(h.size + MERKLE_CHUNK - 1) / MERKLE_CHUNK)
+        goto done;
+
+    size_t body = h.nchunks * h.digest_len;
+    if (!(t->chunks = malloc(body ? body : 1)) ||
+        read(fd, t->chunks, body) != (ssize_t)body) {
+        merkle_free(t);
+        goto done;
+    }
+    t->algo = (HashAlgo)h.algo;
+    t->digest_len = h.digest_len;
+    t->size = h.size;
+    t->nchunks = h.nchunks;
+    t->ino = h.ino;
+    t->mtime_ns = h.mtime_ns;
+    memcpy(t->root, h.root, sizeof(t->root));
+    rc = 0;
+done:
+    close(fd);
+    return rc;
+}
+
+int file_digest_init(FileDigest *d, HashAlgo algo, long long size) {
+    memset(d, 0, sizeof(*d));
+    d->algo = algo;
+    d->size = size;
+    if (size < MERKLE_MIN)
+        return hash_init(&d->ctx, algo);
+    if (tree_init(&d->tree, algo, size) < 0 ||
+        leaf_init(&d->ctx, algo) < 0) {
+        merkle_free(&d->tree);
+        return -1;
+    }
+    return 0;
+}
+
+void file_digest_update(FileDigest *d, const void *buf, size_t n) {
+    const unsigned char *p = buf;
+    if (!d->tree.chunks) {
+        hash_update(&d->ctx, p, n);
+        d->fed += n;
+        return;
+    }
+
+    // Close each leaf at its chunk boundary and open the next one.
+    while (n > 0 && d->fed < d->size) {
+        long long in_chunk = d->fed % MERKLE_CHUNK;
+        size_t take = MERKLE_CHUNK - in_chunk < (long long)n
+                    ? (size_t)(MERKLE_CHUNK - in_chunk) : n;
+        hash_update(&d->ctx, p, take);
+        d->fed += take;
+        p += take;
+        n -= take;
+        if (d->fed % MERKLE_CHUNK == 0 || d->fed == d->size) {
+            uint64_t i = (d->fed - 1) / MERKLE_CHUNK;
+            hash_final(&d->ctx, d->tree.chunks + i * d->tree.digest_len);
+            if (d->fed < d->size)
+                leaf_init(&d->ctx, d->algo);
+        }
+    }
+    d->fed += n;    // past the expected size: final will refuse
+}
+
+// Feeds the zeros of a hole without materialising it.
+void file_digest_zeros(FileDigest *d, long long n) {
+    static const unsigned char zeros[64 << 10];
+    while (n > 0) {
+        size_t take = n < (long long)sizeof(zeros) ? (size_t)n
+                                                   : sizeof(zeros);
+        file_digest_update(d, zeros, take);
+        n -= take;
+    }
+}
+
+// Returns -1 (and leaves len 0) unless exactly `size` bytes were fed.
+int file_digest_final(FileDigest *d) {
+    if (!d->tree.chunks) {
+        size_t len = hash_final(&d->ctx, d->digest);
+        if (d->fed != d->size)
+            return -1;
+        d->len = len;
+        return 0;
+    }
+    if (d->fed != d->size || compute_root(&d->tree) < 0)
+        return -1;
+    d->len = d->tree.digest_len;
+    memcpy(d->digest, d->tree.root, d->len);
+    return 0;
+}
+
+void file_digest_free(FileDigest *d) {
+    merkle_free(&d->tree);
+    // An unfinished SHA-256 context still owns its EVP state.
+    if (d->ctx.md) {
+        unsigned char scratch[HASH_MAX_DIGEST];
+        hash_final(&d->ctx, scratch);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "hash.h"
+
+#define MERKLE_CHUNK (4LL << 20)
+#define MERKLE_MIN (64LL << 20)     // smaller files are hashed linearly
+
+// Digests of the fixed chunks of one file and the root over them. The
+// root also covers the file size.
+typedef struct {
+    HashAlgo algo;
+    size_t digest_len;
+    long long size;
+    uint64_t nchunks;
+    unsigned char *chunks;          // nchunks * digest_len bytes
+    unsigned char root[HASH_MAX_DIGEST];
+    // Set by the caller when saving, checked when loading.
+    uint64_t ino;
+    int64_t mtime_ns;
+} MerkleTree;
+
+// Digest of a whole file fed in order, as file_hash would compute it: a
+// linear hash below MERKLE_MIN, the chunk tree at or above it.
+typedef struct {
+    HashAlgo algo;
+    long long size, fed;
+    HashCtx ctx;                    // current leaf, or the whole file
+    MerkleTree tree;                // chunks, for tree-hashed sizes
+    size_t len;                     // set by file_digest_final
+    unsigned char digest[HASH_MAX_DIGEST];
+} FileDigest;
+
+int merkle_build(int fd, HashAlgo algo, const int *cancel, MerkleTree *t);
+void merkle_free(MerkleTree *t);
+long long merkle_diff(const MerkleTree *a, const MerkleTree *b,
+                      uint64_t first, uint64_t *next);
+int merkle_save(const char *path, const MerkleTree *t);
+int merkle_load(const char *path, MerkleTree *t);
+
+int file_digest_init(FileDigest *d, HashAlgo algo, long long size);
+void file_digest_update(FileDigest *d, const void *buf, size_t n);
+void file_digest_zeros(FileDigest *d, long long n);
+int file_digest_final(FileDigest *d);
+void file_digest_free(FileDigest *d);
+
+#endif
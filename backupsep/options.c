@@ -0,0 +1,214 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include "options.h"
+
+#define MAX_THREADS 256
+#define DEFAULT_DELTA_MIN (64LL << 20)
+#define DEFAULT_COMMIT_FILES 256
+#define DEFAULT_COMMIT_MS 1000
+#define DEFAULT_STALE_MS 5000
+#define DEFAULT_EVENT_BUF (256LL << 10)
+#define MAX_EVENT_BUF (64LL << 20)
+#define DEFAULT_BACKLOG (16LL << 20)
+#define MAX_BACKLOG (1LL << 30)
+#define DEFAULT_QUIET_MS 100
+#define DEFAULT_INTERVAL_MS 1000
+
+static const char *sync_names[] = {"none", "atomic", "batch", "always"};
+static const char *backend_names[] = {"inotify", "fanotify", "auto"};
+
+void options_init(BackupOptions *opt) {
+    opt->threads = 1;
+    opt->engine = ENGINE_KERNEL;
+    opt->delta_min = DEFAULT_DELTA_MIN;
+    opt->sync = SYNC_NONE;
+    opt->commit_files = DEFAULT_COMMIT_FILES;
+    opt->commit_ms = DEFAULT_COMMIT_MS;
+    opt->xattrs = 0;
+    opt->hash = HASH_FAST;
+    opt->fused = 0;         // would trade copy_file_range for read/write
+    opt->backend = BACKEND_INOTIFY;
+    opt->stale_ms = DEFAULT_STALE_MS;
+    opt->event_buf = DEFAULT_EVENT_BUF;
+    opt->backlog = DEFAULT_BACKLOG;
+    opt->quiet_ms = DEFAULT_QUIET_MS;
+    opt->interval_ms = DEFAULT_INTERVAL_MS;
+    opt->executors = 1;
+}
+
+const char *sync_policy_name(SyncPolicy p) {
+    return sync_names[p];
+}
+
+static int parse_int(const char *s, long min, long max, long *out) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (*s == '\0' || *end != '\0' || v < min || v > max)
+        return -1;
+    *out = v;
+    return 0;
+}
+
+void options_usage(void) {
+    printf("  -j threads     initial sync threads (1)\n"
+           "  -a threads     threads applying file changes (1)\n"
+           "  -e engine      copy engine: kernel or uring (kernel)\n"
+           "  -d size        delta-sync files at least this big, 0 = off (64M)\n"
+           "  -s policy      durability: none, atomic, batch, always (none)\n"
+           "  -n files       batch: commit after this many files (%d)\n"
+           "  -t ms          batch: commit after this many ms (%d)\n"
+           "  -x on|off      copy extended attributes (off)\n"
+           "  -c hash        manifest digests: fast or sha256 (fast)\n"
+           "  -f on|off      hash files while copying them (off)\n"
+           "  -w backend     change events: inotify, fanotify, auto (inotify)\n"
+           "  -m ms          replicate files still open after this many ms,\n"
+           "                 0 = on every write (%d)\n"
+           "  -b size        event read buffer (256K)\n"
+           "  -B size        events held while the worker is busy (16M)\n"
+           "  -q ms          apply a file's events once it is this quiet (%d)\n"
+           "  -r ms          replicate a file at most once per this many ms,\n"
+           "                 -q 0 -r 0 applies every event at once (%d)\n",
+           DEFAULT_COMMIT_FILES, DEFAULT_COMMIT_MS, DEFAULT_STALE_MS,
+           DEFAULT_QUIET_MS, DEFAULT_INTERVAL_MS);
+}
+
+// Accepts a byte count with an optional K, M or G suffix.
+static int parse_size(const char *s, long long *out) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (*s == '\0' || v < 0 || errno == ERANGE)
+        return -1;
+    int shift = 0;
+    switch (*end) {
+    case 'K': case 'k': shift = 10; end++; break;
+    case 'M': case 'm': shift = 20; end++; break;
+    case 'G': case 'g': shift = 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0' || v > (LLONG_MAX >> shift))
+        return -1;
+    *out = v << shift;
+    return 0;
+}
+
+// Parses leading "-x value" flags after the command name.
+// Returns the index of the first positional argument, or -1.
+int parse_options(int argc, char **argv, BackupOptions *opt) {
+    int i = 1;
+    while (i < argc && argv[i][0] == '-') {
+        if (i + 1 >= argc) {
+            printf("Option %s needs a value\n", argv[i]);
+            return -1;
+        }
+
+        long v;
+        if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "-a")) {
+            if (parse_int(argv[i + 1], 1, MAX_THREADS, &v) < 0) {
+                printf("Invalid thread count: %s\n", argv[i + 1]);
+                return -1;
+            }
+            if (argv[i][1] == 'j')
+                opt->threads = (int)v;
+            else
+                opt->executors = (int)v;
+        } else if (!strcmp(argv[i], "-e")) {
+            if (!strcmp(argv[i + 1], "kernel")) {
+                opt->engine = ENGINE_KERNEL;
+            } else if (!strcmp(argv[i + 1], "uring")) {
+                opt->engine = ENGINE_URING;
+            } else {
+                printf("Unknown copy engine: %s\n", argv[i + 1]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-d")) {
+            if (parse_size(argv[i + 1], &opt->delta_min) < 0) {
+                printf("Invalid size: %s\n", argv[i + 1]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-s")) {
+            int found = 0;
+            for (int k = 0; k < 4; k++) {
+                if (!strcmp(argv[i + 1], sync_names[k])) {
+                    opt->sync = (SyncPolicy)k;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                printf("Unknown sync policy: %s\n", argv[i + 1]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-n")) {
+            if (parse_int(argv[i + 1], 1, 1 << 20, &v) < 0) {
+                printf("Invalid file count: %s\n", argv[i + 1]);
+                return -1;
+            }
+            opt->commit_files = (int)v;
+        } else if (!strcmp(argv[i], "-t")) {
+            if (parse_int(argv[i + 1], 1, 3600000, &v) < 0) {
+                printf("Invalid interval: %s\n", argv[i + 1]);
+                return -1;
+            }
+            opt->commit_ms = (int)v;
+        } else if (!strcmp(argv[i], "-b")) {
+            if (parse_size(argv[i + 1], &opt->event_buf) < 0 ||
+                opt->event_buf < EVENT_BUF_MIN ||
+                opt->event_buf > MAX_EVENT_BUF) {
+                printf("Invalid buffer size: %s\n", argv[i + 1]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-B")) {
+            if (parse_size(argv[i + 1], &opt->backlog) < 0 ||
+                opt->backlog < EVENT_BUF_MIN ||
+                opt->backlog > MAX_BACKLOG) {
+                printf("Invalid buffer size: %s\n", argv[i + 1]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "-q") ||
+                   !strcmp(argv[i], "-r")) {
+            if (parse_int(argv[i + 1], 0, 3600000, &v) < 0) {
+                printf("Invalid interval: %s\n", argv[i + 1]);
+                return -1;
+            }
+            int *ms = argv[i][1] == 'm' ? &opt->stale_ms :
+                      argv[i][1] == 'q' ? &opt->quiet_ms : &opt->interval_ms;
+            *ms = (int)v;
+        } else if (!strcmp(argv[i], "-w")) {
+            int found = 0;
+            for (int k = 0; k < 3; k++) {
+                if (!strcmp(argv[i + 1], backend_names[k])) {
+                    opt->backend = (EventBackend)k;
+                    found = 1;
+                }
+            }
+            if (!found) {
+                printf("Unknown backend: %s\n", argv[i + 1]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-c")) {
+            if (hash_parse(argv[i + 1], &opt->hash) < 0) {
+                printf("Unknown hash: %s\n", argv[i + 1]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "-x") || !strcmp(argv[i], "-f")) {
+            int *flag = argv[i][1] == 'x' ? &opt->xattrs : &opt->fused;
+            if (!strcmp(argv[i + 1], "on")) {
+                *flag = 1;
+            } else if (!strcmp(argv[i + 1], "off")) {
+                *flag = 0;
+            } else {
+                printf("Expected on or off: %s\n", argv[i + 1]);
+                return -1;
+            }
+        } else {
+            printf("Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+        i += 2;
+    }
+    return i;
+}
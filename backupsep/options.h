@@ -0,0 +1,43 @@
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include "hash.h"
+#include "events.h"
+
+typedef enum {
+    ENGINE_KERNEL,  // copy_file_range and friends, one file at a time
+    ENGINE_URING    // batched io_uring for small files
+} CopyEngine;
+
+typedef enum {
+    SYNC_NONE,      // rewrite targets in place, never fsync
+    SYNC_ATOMIC,    // stage and rename, never fsync
+    SYNC_BATCH,     // stage, then group commit every N files or T ms
+    SYNC_ALWAYS     // stage, fsync and rename each file
+} SyncPolicy;
+
+typedef struct {
+    int threads;    // initial sync threads, 1 keeps the serial walk
+    CopyEngine engine;
+    long long delta_min;    // files this large get block deltas, 0 = never
+    SyncPolicy sync;
+    int commit_files;       // SYNC_BATCH: commit after this many files
+    int commit_ms;          // SYNC_BATCH: or after this many milliseconds
+    int xattrs;             // replicate extended attributes
+    HashAlgo hash;          // digests kept in the target's manifest
+    int fused;              // hash while copying instead of afterwards
+    EventBackend backend;   // how changes are noticed
+    int stale_ms;           // files open this long are replicated anyway
+    long long event_buf;    // bytes of events taken per read
+    long long backlog;      // bytes of events held for the worker to apply
+    int quiet_ms;           // merge a file's events until it is this quiet
+    int interval_ms;        // replicate a file at most once this often
+    int executors;          // threads applying file changes
+} BackupOptions;
+
+void options_init(BackupOptions *opt);
+int parse_options(int argc, char **argv, BackupOptions *opt);
+void options_usage(void);
+const char *sync_policy_name(SyncPolicy p);
+
+#endif
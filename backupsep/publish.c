@@ -0,0 +1,424 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include "publish.h"
+#include "manifest.h"
+
+// Crash-safe publishing of copied files. Except under SYNC_NONE, a file
+// is written into an anonymous O_TMPFILE next to its target (or a temp
+// file where that is unsupported) and renamed over it only once
+// complete, so readers never see a torn copy. Named temp files live in
+// META_DIR/staging, which is emptied on start, rather than all over the
+// target. Under SYNC_BATCH staged
+// files are held back and committed as a group: one syncfs() makes all
+// of their data durable, then they are renamed into place and each
+// parent directory is fsynced once. When the manifest asks for it, the
+// copy also hashes what it writes and the digest is recorded on publish.
+//
+// Each staged file holds an fd until its commit, so a batch is also
+// committed once it holds half of RLIMIT_NOFILE.
+
+#define STAGING_DIR "staging"   // below META_DIR
+
+typedef struct {
+    int fd;             // staged content
+    char *dst;
+    char *tmp;          // named temp file, NULL while still anonymous
+    FileDigest *digest; // of the staged content, or NULL
+    PublishHook done;
+} Staged;
+
+static SyncPolicy policy = SYNC_NONE;
+static int commit_files = 1;
+static int commit_ms;
+static int max_staged = INT_MAX;
+static int target_fd = -1;      // any fd on the target filesystem
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static Staged *staged;
+static int nstaged, staged_cap;
+static int dirty;               // in-place writes since the last commit
+static struct timespec last_commit;
+static unsigned long tmp_seq;
+static char staging[PATH_MAX];  // for named temp files; "" if unusable
+static dev_t staging_dev;
+
+static long long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000LL +
+           (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Empties the staging directory of what a previous run left behind
+// when it died mid-commit.
+static void sweep_staging(void) {
+    DIR *d = opendir(staging);
+    if (!d) {
+        staging[0] = '\0';
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..") &&
+            unlinkat(dirfd(d), de->d_name, 0) < 0)
+            perror(de->d_name);
+    }
+    closedir(d);
+}
+
+void publish_init(const char *target, const BackupOptions *opt) {
+    policy = opt->sync;
+    commit_files = opt->commit_files;
+    commit_ms = opt->commit_ms;
+    target_fd = open(target, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    clock_gettime(CLOCK_MONOTONIC, &last_commit);
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        max_staged = rl.rlim_cur / 2 > 1 ? (int)(rl.rlim_cur / 2) : 1;
+
+    // Named temp files go in one directory of the target's own, so a
+    // restart only has to look there for leftovers.
+    struct stat st;
+    int n = snprintf(staging, sizeof(staging), "%s/%s", target, META_DIR);
+    if (n < 0 || n >= (int)sizeof(staging) - (int)sizeof(STAGING_DIR) ||
+        (mkdir(staging, 0700) < 0 && errno != EEXIST)) {
+        staging[0] = '\0';
+        return;
+    }
+    strcat(staging, "/" STAGING_DIR);
+    if ((mkdir(staging, 0700) < 0 && errno != EEXIST) ||
+        stat(staging, &st) < 0) {
+        staging[0] = '\0';
+        return;
+    }
+    staging_dev = st.st_dev;
+    sweep_staging();
+}
+
+static void split_path(const char *path, char *dir, const char **base) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        strcpy(dir, ".");
+        *base = path;
+        return;
+    }
+    size_t len = slash - path;
+    if (len == 0) len = 1;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    *base = slash + 1;
+}
+
+// A fresh temp name for dst: in the staging directory, or, where that
+// is on another filesystem than dst, beside dst itself. Those are only
+// cleaned up by a resume's prune.
+static char *temp_name(const char *dst, int beside) {
+    char dir[PATH_MAX], *name = malloc(PATH_MAX);
+    const char *base;
+    if (!name) return NULL;
+
+    unsigned long seq = __atomic_add_fetch(&tmp_seq, 1, __ATOMIC_RELAXED);
+    int n;
+    if (beside || !staging[0]) {
+        split_path(dst, dir, &base);
+        n = snprintf(name, PATH_MAX, "%s/.%s.%d-%lu.bk", dir, base,
+                     (int)getpid(), seq);
+    } else {
+        n = snprintf(name, PATH_MAX, "%s/%d-%lu.bk", staging,
+                     (int)getpid(), seq);
+    }
+    if (n < 0 || n >= PATH_MAX) {
+        free(name);
+        return NULL;
+    }
+    return name;
+}
+
+static int stage(const char *dst, Staged *s) {
+    char dir[PATH_MAX];
+    const char *base;
+    split_path(dst, dir, &base);
+
+    s->tmp = NULL;
+    s->fd = open_target(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+    if (s->fd >= 0)
+        return 0;
+
+    struct stat st;
+    int beside = stat(dir, &st) < 0 || st.st_dev != staging_dev;
+    if (!(s->tmp = temp_name(dst, beside)))
+        return -1;
+    s->fd = open_target(s->tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (s->fd < 0) {
+        free(s->tmp);
+        s->tmp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// A digest to fill in while copying, if the manifest wants one.
+static FileDigest *want_digest(HashAlgo *algo) {
+    return manifest_copy_algo(algo) ? malloc(sizeof(FileDigest)) : NULL;
+}
+
+// Records dst, if it was published, and lets go of its digest.
+static void recorded(const char *dst, FileDigest *d) {
+    if (dst)
+        manifest_record_digest(dst, d);
+    if (d) {
+        file_digest_free(d);
+        free(d);
+    }
+}
+
+static void discard(Staged *s) {
+    close(s->fd);
+    if (s->tmp) {
+        unlink(s->tmp);
+        free(s->tmp);
+    }
+}
+
+// Links the staged file in under a temp name, unless it has one, and
+// renames it over its target.
+static int place(Staged *s) {
+    if (!s->tmp) {
+        char proc[64];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", s->fd);
+        for (int beside = 0; !s->tmp && beside < 2; beside++) {
+            if (!(s->tmp = temp_name(s->dst, beside)))
+                return -1;
+            if (linkat(AT_FDCWD, proc, AT_FDCWD, s->tmp,
+                       AT_SYMLINK_FOLLOW) < 0) {
+                int err = errno;
+                free(s->tmp);
+                s->tmp = NULL;
+                errno = err;
+                if (err != EXDEV)
+                    return -1;
+            }
+        }
+        if (!s->tmp)
+            return -1;
+    }
+    return rename(s->tmp, s->dst);
+}
+
+// Gives the staged file its final name. Consumes s.
+static int publish_one(Staged *s) {
+    int rc = place(s);
+    if (rc < 0 && errno == EACCES) {
+        // Its directory was replicated read-only: lend it write access.
+        char dir[PATH_MAX];
+        const char *base;
+        mode_t was;
+        split_path(s->dst, dir, &base);
+        if (lend_write(dir, &was)) {
+            rc = place(s);
+            lend_return(dir, was);
+        }
+    }
+    if (rc < 0) {
+        perror(s->dst);
+        if (s->tmp) unlink(s->tmp);
+    }
+    close(s->fd);
+    free(s->tmp);
+    return rc;
+}
+
+static void sync_dir_of(const char *path) {
+    char dir[PATH_MAX];
+    const char *base;
+    split_path(path, dir, &base);
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+static int same_dir(const char *a, const char *b) {
+    const char *sa = strrchr(a, '/'), *sb = strrchr(b, '/');
+    return sa && sb && sa - a == sb - b && !strncmp(a, b, sa - a);
+}
+
+static void commit_locked(void) {
+    if (nstaged == 0 && dirty == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &last_commit);
+        return;
+    }
+
+    // One flush covers every staged and in-place write on the target.
+    if (target_fd < 0 || syncfs(target_fd) < 0) {
+        for (int i = 0; i < nstaged; i++)
+            fsync(staged[i].fd);
+    }
+
+    for (int i = 0; i < nstaged; i++) {
+        if (publish_one(&staged[i]) == 0)
+            recorded(staged[i].dst, staged[i].digest);
+        else
+            recorded(NULL, staged[i].digest);
+    }
+
+    for (int i = 0; i < nstaged; i++) {
+        int seen = 0;
+        for (int k = 0; k < i && !seen; k++)
+            seen = same_dir(staged[k].dst, staged[i].dst);
+        if (!seen)
+            sync_dir_of(staged[i].dst);
+    }
+
+    for (int i = 0; i < nstaged; i++) {
+        if (staged[i].done)
+            staged[i].done(staged[i].dst);
+        free(staged[i].dst);
+    }
+    nstaged = 0;
+    dirty = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_commit);
+}
+
+int publish_copy(const char *src, const char *dst, CopyResult *res,
+                 PublishHook done) {
+    HashAlgo algo;
+    FileDigest *d = want_digest(&algo);
+
+    if (policy == SYNC_NONE) {
+        int rc = d ? copy_file_hashed(src, dst, res, algo, d)
+                   : copy_file(src, dst, res);
+        recorded(rc == 0 ? dst : NULL, d);
+        if (rc == 0 && done) done(dst);
+        return rc;
+    }
+
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        free(d);
+        return -1;
+    }
+
+    // Out of fds most likely means the batch is holding them: commit it
+    // and try once more.
+    Staged s;
+    int staged_ok = stage(dst, &s);
+    if (staged_ok < 0 && (errno == EMFILE || errno == ENFILE) &&
+        policy == SYNC_BATCH) {
+        publish_flush();
+        staged_ok = stage(dst, &s);
+    }
+    if (staged_ok < 0) {
+        close(in);
+        free(d);
+        return -1;
+    }
+    int rc = d ? copy_fd_hashed(in, s.fd, res, algo, d)
+               : copy_fd(in, s.fd, res);
+    close(in);
+    if (rc < 0 || !(s.dst = strdup(dst))) {
+        discard(&s);
+        recorded(NULL, d);
+        return -1;
+    }
+    s.digest = d;
+    s.done = done;
+
+    if (policy != SYNC_BATCH) {
+        if (policy == SYNC_ALWAYS)
+            fsync(s.fd);
+        rc = publish_one(&s);
+        if (policy == SYNC_ALWAYS)
+            sync_dir_of(dst);
+        recorded(rc == 0 ? dst : NULL, d);
+        if (rc == 0 && done) done(dst);
+        free(s.dst);
+        return rc;
+    }
+
+    pthread_mutex_lock(&lock);
+    if (nstaged == staged_cap) {
+        int cap = staged_cap ? staged_cap * 2 : 64;
+        Staged *n = realloc(staged, cap * sizeof(*n));
+        if (!n) {
+            commit_locked();
+            n = staged;
+        } else {
+            staged = n;
+            staged_cap = cap;
+        }
+    }
+    if (nstaged < staged_cap) {
+        staged[nstaged++] = s;
+    } else {
+        // Out of memory with nothing staged: publish on its own.
+        rc = publish_one(&s);
+        recorded(rc == 0 ? dst : NULL, d);
+        free(s.dst);
+    }
+    if (nstaged + dirty >= commit_files || nstaged >= max_staged)
+        commit_locked();
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+// Records an in-place update of dst so it is part of the next commit.
+void publish_dirty(const char *dst) {
+    manifest_record(dst);
+    if (policy == SYNC_ALWAYS) {
+        int fd = open(dst, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    } else if (policy == SYNC_BATCH) {
+        pthread_mutex_lock(&lock);
+        if (++dirty + nstaged >= commit_files)
+            commit_locked();
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+int publish_pending(const char *dst) {
+    int found = 0;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < nstaged && !found; i++)
+        found = !strcmp(staged[i].dst, dst);
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+// Commits the batch once it is commit_ms old. Returns the ms until the
+// files held back are due, or -1 if there are none.
+long long publish_tick(void) {
+    if (policy != SYNC_BATCH) return -1;
+    long long due = -1;
+    pthread_mutex_lock(&lock);
+    long long ms = elapsed_ms(&last_commit);
+    if (ms >= commit_ms)
+        commit_locked();
+    else if (nstaged > 0 || dirty > 0)
+        due = commit_ms - ms;
+    pthread_mutex_unlock(&lock);
+    return due;
+}
+
+void publish_flush(void) {
+    pthread_mutex_lock(&lock);
+    commit_locked();
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,17 @@
+#ifndef PUBLISH_H
+#define PUBLISH_H
+
+#include "copy.h"
+#include "options.h"
+
+typedef void (*PublishHook)(const char *dst);
+
+void publish_init(const char *target, const BackupOptions *opt);
+int publish_copy(const char *src, const char *dst, CopyResult *res,
+                 PublishHook done);
+void publish_dirty(const char *dst);
+int publish_pending(const char *dst);
+long long publish_tick(void);
+void publish_flush(void);
+
+#endif
@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <errno.h>
+#include "resync.h"
+#include "utils.h"
+#include "walk.h"
+#include "hash.h"
+#include "manifest.h"
+
+// Reconciliation after lost events. The times of every source directory
+// are remembered, keyed by a hash of its path; a pass walks the source
+// and compares the two sides only in directories whose mtime or ctime
+// moved since, which is where entries were added, removed or renamed.
+// Elsewhere it only checks regular files against the manifest, since
+// rewriting a file leaves its directory alone. A pass visits a few
+// directories per resync_step, so the worker keeps handling events in
+// between, and the times it records become the known state once it
+// finishes.
+
+#define RESYNC_DIRS 32      // directories per step
+#define INITIAL_SLOTS 1024
+
+typedef struct {
+    uint64_t key;           // 0 = empty
+    int64_t mtime_ns, ctime_ns;
+} DirTimes;
+
+typedef struct {
+    DirTimes *slots;
+    size_t nslots, count;
+} DirTable;
+
+struct Resync {
+    char source[PATH_MAX];
+    char target[PATH_MAX];
+    size_t source_len;
+    ResyncOps ops;
+    WorkerStats *stats;
+    DirTable known;         // as of the last finished pass
+    DirTable next;          // filled by the running pass
+    char **stack;           // directories still to visit
+    size_t depth, cap;
+    int running, again;
+};
+
+static int64_t ts_ns(struct timespec ts) {
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t dir_key(const char *path) {
+    uint64_t key = hash64(path, strlen(path));
+    return key ? key : 1;
+}
+
+static DirTimes *table_slot(const DirTable *t, uint64_t key) {
+    size_t mask = t->nslots - 1;
+    if (!t->nslots) return NULL;
+    size_t i = key & mask;
+    while (t->slots[i].key && t->slots[i].key != key)
+        i = (i + 1) & mask;
+    return &t->slots[i];
+}
+
+static void table_put(DirTable *t, const char *path, const struct stat *st) {
+    if ((t->count + 1) * 4 > t->nslots * 3) {
+        DirTable n = {0};
+        n.nslots = t->nslots ? t->nslots * 2 : INITIAL_SLOTS;
+        if (!(n.slots = calloc(n.nslots, sizeof(*n.slots))))
+            return;
+        for (size_t i = 0; i < t->nslots; i++)
+            if (t->slots[i].key)
+                *table_slot(&n, t->slots[i].key) = t->slots[i];
+        n.count = t->count;
+        free(t->slots);
+        *t = n;
+    }
+    uint64_t key = dir_key(path);
+    DirTimes *d = table_slot(t, key);
+    if (!d->key) t->count++;
+    d->key = key;
+    d->mtime_ns = ts_ns(st->st_mtim);
+    d->ctime_ns = ts_ns(st->st_ctim);
+}
+
+static int table_changed(const DirTable *t, const char *path,
+                         const struct stat *st) {
+    DirTimes *d = table_slot(t, dir_key(path));
+    return !d || !d->key || d->mtime_ns != ts_ns(st->st_mtim) ||
+           d->ctime_ns != ts_ns(st->st_ctim);
+}
+
+Resync *resync_new(const char *source, const char *target,
+                   const ResyncOps *ops, WorkerStats *stats) {
+    Resync *r = calloc(1, sizeof(*r));
+    if (!r || strlen(source) >= sizeof(r->source) ||
+        strlen(target) >= sizeof(r->target)) {
+        free(r);
+        return NULL;
+    }
+    strcpy(r->source, source);
+    strcpy(r->target, target);
+    r->source_len = strlen(source);
+    r->ops = *ops;
+    r->stats = stats;
+    return r;
+}
+
+void resync_free(Resync *r) {
+    if (!r) return;
+    for (size_t i = 0; i < r->depth; i++)
+        free(r->stack[i]);
+    free(r->stack);
+    free(r->known.slots);
+    free(r->next.slots);
+    free(r);
+}
+
+static int baseline_visit(const WalkEntry *e, WalkEvent ev, void *arg) {
+    struct stat st;
+    if (ev == WALK_ENTER &&
+        fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        table_put(arg, e->path, &st);
+    return WALK_CONTINUE;
+}
+
+// Records the directory times the worker starts from. Taken before the
+// initial sync, so whatever changes during it is rescanned later.
+void resync_baseline(Resync *r) {
+    walk_tree(r->source, baseline_visit, &r->known);
+}
+
+static void push(Resync *r, const char *path) {
+    if (r->depth == r->cap) {
+        size_t cap = r->cap ? r->cap * 2 : 64;
+        char **s = realloc(r->stack, cap * sizeof(*s));
+        if (!s) return;
+        r->stack = s;
+        r->cap = cap;
+    }
+    char *p = strdup(path);
+    if (p)
+        r->stack[r->depth++] = p;
+}
+
+static void start(Resync *r) {
+    free(r->next.slots);
+    memset(&r->next, 0, sizeof(r->next));
+    push(r, r->source);
+    r->running = 1;
+    r->again = 0;
+}
+
+// Asks for a pass. One already running is followed by another, since
+// the lost events may be in directories it has already visited.
+void resync_request(Resync *r) {
+    if (r->running)
+        r->again = 1;
+    else
+        start(r);
+}
+
+static int is_dir(const char *path) {
+    struct stat st;
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static unsigned char entry_type(const char *path, const struct dirent *d) {
+    struct stat st;
+    if (d->d_type != DT_UNKNOWN)
+        return d->d_type;
+    if (lstat(path, &st) < 0)
+        return DT_UNKNOWN;
+    return S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG
+                                                             : DT_LNK;
+}
+
+// The metadata directory is never replicated, so it is passed over at
+// the root of either side, as the initial sync and the events do.
+static int skip_name(const Resync *r, const char *dir, const char *name) {
+    return !strcmp(name, ".") || !strcmp(name, "..") ||
+           (!strcmp(name, META_DIR) &&
+            (!strcmp(dir, r->source) || !strcmp(dir, r->target)));
+}
+
+// Replaces whatever dst is with a fresh copy of src.
+static void recreate(Resync *r, const char *src, const char *dst) {
+    struct stat st;
+    if (lstat(dst, &st) == 0)
+        r->ops.remove(dst, S_ISDIR(st.st_mode), r->ops.arg);
+    r->ops.create(src, dst, r->ops.arg);
+    STAT_ADD(r->stats, repaired, 1);
+}
+
+// Removes what the target has below dst that src no longer does.
+static void prune(Resync *r, const char *src, const char *dst) {
+    DIR *d = opendir(dst);
+    if (!d) return;
+    struct dirent *de;
+    char s[PATH_MAX], t[PATH_MAX];
+    struct stat st;
+    while ((de = readdir(d))) {
+        if (skip_name(r, dst, de->d_name))
+            continue;
+        int n = snprintf(s, sizeof(s), "%s/%s", src, de->d_name);
+        int m = snprintf(t, sizeof(t), "%s/%s", dst, de->d_name);
+        if (n < 0 || n >= (int)sizeof(s) || m < 0 || m >= (int)sizeof(t))
+            continue;
+        if (lstat(s, &st) < 0 && errno == ENOENT) {
+            r->ops.remove(t, entry_type(t, de) == DT_DIR, r->ops.arg);
+            STAT_ADD(r->stats, repaired, 1);
+        }
+    }
+    closedir(d);
+}
+
+static void visit(Resync *r, const char *src) {
+    char dst[PATH_MAX];
+    struct stat st;
+    int n = snprintf(dst, sizeof(dst), "%s%s", r->target,
+                     src + r->source_len);
+    if (n < 0 || n >= (int)sizeof(dst) || lstat(src, &st) < 0 ||
+        !S_ISDIR(st.st_mode))
+        return;
+
+    // The times go in before the listing, so a change made while it is
+    // read shows up next pass.
+    int changed = table_changed(&r->known, src, &st);
+    table_put(&r->next, src, &st);
+    if (changed) {
+        STAT_ADD(r->stats, rescanned, 1);
+        if (!is_dir(dst)) {
+            recreate(r, src, dst);
+            return;
+        }
+        r->ops.watch(src, r->ops.arg);
+    }
+
+    DIR *d = opendir(src);
+    if (!d) return;
+    struct dirent *de;
+    char s[PATH_MAX], t[PATH_MAX];
+    while ((de = readdir(d))) {
+        if (skip_name(r, src, de->d_name))
+            continue;
+        n = snprintf(s, sizeof(s), "%s/%s", src, de->d_name);
+        int m = snprintf(t, sizeof(t), "%s/%s", dst, de->d_name);
+        if (n < 0 || n >= (int)sizeof(s) || m < 0 || m >= (int)sizeof(t))
+            continue;
+
+        unsigned char type = entry_type(s, de);
+        struct stat ts;
+        int have = lstat(t, &ts) == 0;
+        if (type == DT_DIR) {
+            if (changed && (!have || !S_ISDIR(ts.st_mode)))
+                recreate(r, s, t);
+            else
+                push(r, s);
+        } else if (changed && (!have || S_ISDIR(ts.st_mode) ||
+                               (type == DT_REG) != S_ISREG(ts.st_mode))) {
+            recreate(r, s, t);
+        } else if (type == DT_REG && !copy_unchanged(s, t)) {
+            r->ops.update(s, t, r->ops.arg);
+            STAT_ADD(r->stats, repaired, 1);
+        }
+    }
+    closedir(d);
+
+    if (changed)
+        prune(r, src, dst);
+}
+
+// Visits the next few directories of the running pass. Returns 1 while
+// a pass is in progress.
+int resync_step(Resync *r) {
+    if (!r->running)
+        return 0;
+    for (int i = 0; i < RESYNC_DIRS && r->depth > 0; i++) {
+        char *src = r->stack[--r->depth];
+        visit(r, src);
+        free(src);
+    }
+    if (r->depth > 0)
+        return 1;
+
+    // Done: what this pass saw is the new known state.
+    free(r->known.slots);
+    r->known = r->next;
+    memset(&r->next, 0, sizeof(r->next));
+    r->running = 0;
+    STAT_ADD(r->stats, resyncs, 1);
+    if (r->again)
+        start(r);
+    return r->running;
+}
@@ -0,0 +1,24 @@
+#ifndef RESYNC_H
+#define RESYNC_H
+
+#include "stats.h"
+
+// What a reconciliation pass asks the worker to do to the target.
+typedef struct {
+    void (*create)(const char *src, const char *dst, void *arg);
+    void (*remove)(const char *dst, int dir, void *arg);
+    void (*update)(const char *src, const char *dst, void *arg);
+    void (*watch)(const char *dir, void *arg);
+    void *arg;
+} ResyncOps;
+
+typedef struct Resync Resync;
+
+Resync *resync_new(const char *source, const char *target,
+                   const ResyncOps *ops, WorkerStats *stats);
+void resync_free(Resync *r);
+void resync_baseline(Resync *r);
+void resync_request(Resync *r);
+int resync_step(Resync *r);
+
+#endif
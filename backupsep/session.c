@@ -0,0 +1,112 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "session.h"
+
+// Sessions are hashed by target path and also kept on a list in the
+// order they started, so expiry only looks at the oldest ones.
+
+#define SESSION_BUCKETS 256
+
+typedef struct Session {
+    struct Session *hnext;          // bucket chain
+    struct Session *prev, *next;    // oldest first
+    char *src, *dst;
+    struct timespec since;          // first write not yet replicated
+} Session;
+
+static Session *buckets[SESSION_BUCKETS];
+static Session *oldest, *newest;
+
+static unsigned bucket(const char *s) {
+    unsigned h = 5381;
+    while (*s)
+        h = h * 33 + (unsigned char)*s++;
+    return h % SESSION_BUCKETS;
+}
+
+static Session **find(const char *dst) {
+    Session **pp = &buckets[bucket(dst)];
+    while (*pp && strcmp((*pp)->dst, dst))
+        pp = &(*pp)->hnext;
+    return pp;
+}
+
+static void unlink_session(Session **pp) {
+    Session *s = *pp;
+    *pp = s->hnext;
+    if (s->prev) s->prev->next = s->next; else oldest = s->next;
+    if (s->next) s->next->prev = s->prev; else newest = s->prev;
+}
+
+static void free_session(Session *s) {
+    free(s->src);
+    free(s->dst);
+    free(s);
+}
+
+// Notes a write to src. Only the first one of a session is remembered.
+void session_dirty(const char *src, const char *dst) {
+    if (*find(dst))
+        return;
+    Session *s = calloc(1, sizeof(*s));
+    if (!s || !(s->src = strdup(src)) || !(s->dst = strdup(dst))) {
+        if (s) free_session(s);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &s->since);
+
+    unsigned b = bucket(dst);
+    s->hnext = buckets[b];
+    buckets[b] = s;
+    s->prev = newest;
+    if (newest) newest->next = s; else oldest = s;
+    newest = s;
+}
+
+// Ends the session on dst; returns whether there was one.
+int session_end(const char *dst) {
+    Session **pp = find(dst);
+    if (!*pp)
+        return 0;
+    Session *s = *pp;
+    unlink_session(pp);
+    free_session(s);
+    return 1;
+}
+
+// Follows a rename of a file that is still being written.
+void session_move(const char *from, const char *to, const char *to_src) {
+    Session **pp = find(from);
+    if (!*pp)
+        return;
+    Session *s = *pp;
+    struct timespec since = s->since;
+    unlink_session(pp);
+    free_session(s);
+
+    session_dirty(to_src, to);
+    if ((s = *find(to)))
+        s->since = since;
+}
+
+// Replicates, through fn, every file that has gone unreplicated for
+// max_ms while still open, and ends its session; the next write starts
+// a new one. Returns the ms until the next session is due, or -1.
+long long session_expire(long long max_ms, SessionFn fn, void *arg) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (oldest) {
+        Session *s = oldest;
+        long long ms = (now.tv_sec - s->since.tv_sec) * 1000LL +
+                       (now.tv_nsec - s->since.tv_nsec) / 1000000;
+        if (ms < max_ms)
+            return max_ms - ms;
+        unlink_session(find(s->dst));
+        fn(s->src, s->dst, arg);
+        free_session(s);
+    }
+    return -1;
+}
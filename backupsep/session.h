@@ -0,0 +1,14 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+// Files being written in the source and not yet replicated, by target
+// path. A session starts with the first write and ends when the writer
+// closes the file or when it has been open too long.
+typedef void (*SessionFn)(const char *src, const char *dst, void *arg);
+
+void session_dirty(const char *src, const char *dst);
+int session_end(const char *dst);
+void session_move(const char *from, const char *to, const char *to_src);
+long long session_expire(long long max_ms, SessionFn fn, void *arg);
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef STATS_H
+#define STATS_H
+
+// Counters a worker shares with the parent process, shown by `list`.
+// The block is mapped shared before the fork; the worker updates it with
+// relaxed atomics and the parent only reads. The queue fields are gauges
+// the worker overwrites.
+typedef struct {
+    unsigned long events;       // change events handled
+    unsigned long overflows;    // lost events: queue overflows, unknown wds
+    unsigned long resyncs;      // reconciliation passes completed
+    unsigned long rescanned;    // directories those passes compared
+    unsigned long repaired;     // target entries they fixed
+    unsigned long coalesced;    // events merged into one already pending
+    unsigned long queued;       // bytes read but not yet applied
+    unsigned long queued_peak;
+    unsigned long lag_ms;       // how long the last batch waited for apply
+    unsigned long lag_max_ms;
+} WorkerStats;
+
+#define STAT_ADD(s, field, n) \
+    do { if (s) __atomic_add_fetch(&(s)->field, (n), __ATOMIC_RELAXED); } \
+    while (0)
+
+#endif
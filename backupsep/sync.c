@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include "sync.h"
+#include "utils.h"
+#include "manifest.h"
+#include "walk.h"
+
+// Initial sync on a pool of threads. Every directory is a task; each
+// thread pushes the subdirectories it finds onto the bottom of its own
+// deque and pops from there (depth-first, good locality), while idle
+// threads steal from the top of other deques (the oldest, usually the
+// largest, subtrees). The call returns only once every task is done, so
+// the target is complete before the caller starts replaying events.
+// With -j 1 the pool has a single thread, so progress is still reported
+// from the calling one.
+
+typedef struct {
+    char *src;
+    char *dst;
+    mode_t mode;
+} SyncTask;
+
+typedef struct {
+    pthread_mutex_t lock;
+    SyncTask *items;    // live tasks are items[head..tail)
+    size_t head, tail, cap;
+} Deque;
+
+typedef struct {
+    Deque *deques;
+    int nthreads;
+    const char *root;   // source root, whose META_DIR is not copied
+    long pending;       // tasks queued or being processed
+    long queued;        // tasks in the deques, changed under their locks
+    long dirs, files;
+    long long bytes;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_cond;   // a task was queued, or all are done
+    pthread_cond_t idle_cond;   // the pool drained
+} SyncCtx;
+
+typedef struct {
+    SyncCtx *ctx;
+    int id;
+    CopyResult res;
+    UringBatch *ub;     // per-thread ring when the uring engine is used
+} SyncThread;
+
+// The queued count moves with the deque under its lock, so a task is
+// counted before any thief can see it and never goes below zero.
+static void deque_push(Deque *q, SyncTask t, long *queued) {
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        if (q->head > 0) {
+            memmove(q->items, q->items + q->head,
+                    (q->tail - q->head) * sizeof(*q->items));
+            q->tail -= q->head;
+            q->head = 0;
+        } else {
+            size_t cap = q->cap ? q->cap * 2 : 64;
+            SyncTask *items = realloc(q->items, cap * sizeof(*items));
+            if (!items) {
+                pthread_mutex_unlock(&q->lock);
+                perror("realloc");
+                exit(1);
+            }
+            q->items = items;
+            q->cap = cap;
+        }
+    }
+    __atomic_add_fetch(queued, 1, __ATOMIC_SEQ_CST);
+    q->items[q->tail++] = t;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static int deque_pop(Deque *q, SyncTask *t, long *queued) {
+    int ok = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        *t = q->items[--q->tail];
+        __atomic_sub_fetch(queued, 1, __ATOMIC_SEQ_CST);
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+static int deque_steal(Deque *q, SyncTask *t, long *queued) {
+    int ok = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail > q->head) {
+        *t = q->items[q->head++];
+        __atomic_sub_fetch(queued, 1, __ATOMIC_SEQ_CST);
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+static void submit(SyncCtx *ctx, int id, const char *src, const char *dst,
+                   mode_t mode) {
+    SyncTask t;
+    t.src = strdup(src);
+    t.dst = strdup(dst);
+    t.mode = mode;
+    if (!t.src || !t.dst) {
+        perror("strdup");
+        exit(1);
+    }
+
+    __atomic_add_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+    deque_push(&ctx->deques[id], t, &ctx->queued);
+
+    // Signalled under the lock idle threads check the count with, so none
+    // of them can miss the task and sleep.
+    pthread_mutex_lock(&ctx->idle_lock);
+    pthread_cond_signal(&ctx->work_cond);
+    pthread_mutex_unlock(&ctx->idle_lock);
+}
+
+typedef struct {
+    SyncThread *th;
+    const SyncTask *t;
+} DirWalk;
+
+// One level of a task's directory: subdirectories become tasks of their
+// own, everything else is copied here.
+static int sync_visit(const WalkEntry *e, WalkEvent ev, void *arg) {
+    DirWalk *w = arg;
+    SyncThread *th = w->th;
+    SyncCtx *ctx = th->ctx;
+    char p[PATH_MAX];
+    if (copy_cancelled())
+        return -1;
+    if (e->depth == 0 || ev == WALK_LEAVE)
+        return WALK_CONTINUE;
+    if (ev == WALK_ENTER && !strcmp(e->name, META_DIR) &&
+        !strcmp(w->t->src, ctx->root))
+        return WALK_SKIP;
+    if (walk_target(e, w->t->dst, p) < 0)
+        return ev == WALK_ENTER ? WALK_SKIP : WALK_CONTINUE;
+
+    if (ev == WALK_ENTER) {
+        struct stat st;
+        if (fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            submit(ctx, th->id, e->path, p, st.st_mode);
+        return WALK_SKIP;
+    }
+    if (e->type == DT_REG && copy_unchanged(e->path, p))
+        return WALK_CONTINUE; // unchanged since the last copy
+
+    long long before = th->res.bytes;
+    if (th->ub && e->type == DT_REG)
+        uring_batch_add(th->ub, e->path, p, &th->res);
+    else
+        copy_recursive(e->path, p, &th->res);
+    __atomic_add_fetch(&ctx->files, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ctx->bytes, th->res.bytes - before, __ATOMIC_RELAXED);
+    return WALK_CONTINUE;
+}
+
+static void process_dir(SyncThread *th, SyncTask *t) {
+    SyncCtx *ctx = th->ctx;
+    // After a cancel the remaining tasks are only taken off the deques.
+    if (copy_cancelled())
+        return;
+
+    mkdir(t->dst, (t->mode & 0777) | S_IRWXU);
+    __atomic_add_fetch(&ctx->dirs, 1, __ATOMIC_RELAXED);
+
+    DirWalk w = {th, t};
+    walk_tree(t->src, sync_visit, &w);
+}
+
+static int next_task(SyncThread *th, SyncTask *t) {
+    SyncCtx *ctx = th->ctx;
+    if (deque_pop(&ctx->deques[th->id], t, &ctx->queued))
+        return 1;
+    for (int i = 1; i < ctx->nthreads; i++) {
+        int victim = (th->id + i) % ctx->nthreads;
+        if (deque_steal(&ctx->deques[victim], t, &ctx->queued))
+            return 1;
+    }
+    return 0;
+}
+
+static void *sync_thread(void *arg) {
+    SyncThread *th = arg;
+    SyncCtx *ctx = th->ctx;
+
+    while (1) {
+        SyncTask t;
+        if (next_task(th, &t)) {
+            process_dir(th, &t);
+            free(t.src);
+            free(t.dst);
+            if (__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&ctx->idle_lock);
+                pthread_cond_broadcast(&ctx->work_cond);
+                pthread_mutex_unlock(&ctx->idle_lock);
+            }
+            continue;
+        }
+
+        // Sleep until there is something to steal or nothing will come.
+        pthread_mutex_lock(&ctx->idle_lock);
+        while (__atomic_load_n(&ctx->queued, __ATOMIC_SEQ_CST) == 0 &&
+               __atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) > 0)
+            pthread_cond_wait(&ctx->work_cond, &ctx->idle_lock);
+        int done = __atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&ctx->idle_lock);
+        if (done)
+            break;
+    }
+
+    if (th->ub) {
+        long long before = th->res.bytes;
+        uring_batch_flush(th->ub, &th->res);
+        __atomic_add_fetch(&ctx->bytes, th->res.bytes - before,
+                           __ATOMIC_RELAXED);
+    }
+
+    // Wake the progress reporter once the last thread is out.
+    pthread_mutex_lock(&ctx->idle_lock);
+    pthread_cond_broadcast(&ctx->idle_cond);
+    pthread_mutex_unlock(&ctx->idle_lock);
+    return NULL;
+}
+
+static void print_progress(SyncCtx *ctx) {
+    printf("Initial sync: %ld dirs, %ld files, %lld MB\n",
+           __atomic_load_n(&ctx->dirs, __ATOMIC_RELAXED),
+           __atomic_load_n(&ctx->files, __ATOMIC_RELAXED),
+           __atomic_load_n(&ctx->bytes, __ATOMIC_RELAXED) >> 20);
+    fflush(stdout);
+}
+
+static UringBatch *open_batch(const BackupOptions *opt) {
+    if (opt->engine != ENGINE_URING)
+        return NULL;
+    if (opt->sync != SYNC_NONE) {
+        fprintf(stderr, "io_uring engine writes in place, "
+                        "ignored with sync policy %s\n",
+                sync_policy_name(opt->sync));
+        return NULL;
+    }
+    UringBatch *ub = uring_batch_new();
+    if (!ub)
+        fprintf(stderr, "io_uring unavailable, using the kernel copy engine\n");
+    return ub;
+}
+
+int parallel_sync(const char *src, const char *dst,
+                  const BackupOptions *opt, CopyResult *res) {
+    int threads = opt->threads;
+    struct stat st;
+    if (lstat(src, &st) < 0) {
+        perror("lstat");
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        UringBatch *ub = open_batch(opt);
+        copy_recursive_batch(src, dst, ub, res);
+        if (ub) {
+            uring_batch_flush(ub, res);
+            uring_batch_free(ub);
+            copy_dir_metadata_tree(src, dst);
+        }
+        return 0;
+    }
+
+    SyncCtx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.nthreads = threads;
+    ctx.root = src;
+    ctx.deques = calloc(threads, sizeof(*ctx.deques));
+    SyncThread *th = calloc(threads, sizeof(*th));
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    if (!ctx.deques || !th || !tids) {
+        free(ctx.deques);
+        free(th);
+        free(tids);
+        return -1;
+    }
+
+    pthread_mutex_init(&ctx.idle_lock, NULL);
+    pthread_cond_init(&ctx.work_cond, NULL);
+    pthread_cond_init(&ctx.idle_cond, NULL);
+    for (int i = 0; i < threads; i++)
+        pthread_mutex_init(&ctx.deques[i].lock, NULL);
+
+    submit(&ctx, 0, src, dst, st.st_mode);
+
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        th[i].ctx = &ctx;
+        th[i].id = i;
+        th[i].res.method = COPY_NONE;
+        th[i].ub = open_batch(opt);
+        if (pthread_create(&tids[i], NULL, sync_thread, &th[i]) != 0)
+            break;
+        started++;
+    }
+    if (started == 0) {
+        // No threads at all: run the pool inline on this one.
+        ctx.nthreads = 1;
+        sync_thread(&th[0]);
+    }
+
+    // Report progress once a second until the pool drains.
+    struct timespec next;
+    clock_gettime(CLOCK_REALTIME, &next);
+    next.tv_sec++;
+    pthread_mutex_lock(&ctx.idle_lock);
+    while (__atomic_load_n(&ctx.pending, __ATOMIC_SEQ_CST) > 0) {
+        if (pthread_cond_timedwait(&ctx.idle_cond, &ctx.idle_lock, &next)
+                == ETIMEDOUT) {
+            print_progress(&ctx);
+            next.tv_sec++;
+        }
+    }
+    pthread_mutex_unlock(&ctx.idle_lock);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    print_progress(&ctx);
+    copy_dir_metadata_tree(src, dst);
+
+    for (int i = 0; i < threads; i++) {
+        if (res) {
+            res->bytes += th[i].res.bytes;
+            if (th[i].res.method != COPY_NONE)
+                res->method = th[i].res.method;
+        }
+        uring_batch_free(th[i].ub);
+        pthread_mutex_destroy(&ctx.deques[i].lock);
+        free(ctx.deques[i].items);
+    }
+    pthread_mutex_destroy(&ctx.idle_lock);
+    pthread_cond_destroy(&ctx.work_cond);
+    pthread_cond_destroy(&ctx.idle_cond);
+    free(ctx.deques);
+    free(th);
+    free(tids);
+    return 0;
+}
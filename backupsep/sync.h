@@ -0,0 +1,10 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "copy.h"
+#include "options.h"
+
+int parallel_sync(const char *src, const char *dst,
+                  const BackupOptions *opt, CopyResult *res);
+
+#endif
@@ -0,0 +1,156 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "executor.h"
+
+// Checks the ordering the worker relies on: jobs on one key run in the
+// order submitted, whatever their class, and a barrier returns only once
+// every job before it has finished, as a directory operation or a
+// rename needs. Prints one "Name: PASS" line per check, like
+// test_backup.sh, and exits non-zero on any failure.
+
+#define KEYS    16
+#define PER_KEY 200
+#define THREADS 4
+
+typedef struct {
+    int key, seq;
+    int yield;              // call executor_yield midway
+} Step;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int last[KEYS];      // seq of the last job run per key
+static int out_of_order;
+static long done;
+
+static void pause_us(long us) {
+    struct timespec ts = {0, us * 1000};
+    nanosleep(&ts, NULL);
+}
+
+static void run_step(void *arg) {
+    Step *s = arg;
+    if (s->yield) {
+        pause_us(rand() % 50);
+        executor_yield();
+    }
+    pthread_mutex_lock(&lock);
+    if (s->seq != last[s->key] + 1)
+        out_of_order++;
+    last[s->key] = s->seq;
+    done++;
+    pthread_mutex_unlock(&lock);
+    pause_us(rand() % 20);
+    free(s);
+}
+
+static void submit_step(Executor *x, int key, int seq, JobPrio prio) {
+    char name[32];
+    Step *s = malloc(sizeof(*s));
+    if (!s) {
+        perror("malloc");
+        exit(1);
+    }
+    s->key = key;
+    s->seq = seq;
+    s->yield = seq % 7 == 0;
+    snprintf(name, sizeof(name), "dir/file%d", key);
+    executor_submit(x, name, prio, run_step, s);
+}
+
+static int report(const char *name, int ok) {
+    printf("Executor %s: %s\n", name, ok ? "PASS" : "FAIL");
+    return !ok;
+}
+
+// Jobs on one key, in mixed classes, keep their order.
+static int check_fifo(void) {
+    Executor *x = executor_start(THREADS);
+    if (!x) return report("same-key FIFO", 0);
+    memset(last, 0, sizeof(last));
+    out_of_order = 0;
+    for (int seq = 1; seq <= PER_KEY; seq++)
+        for (int key = 0; key < KEYS; key++)
+            submit_step(x, key, seq, (JobPrio)((seq + key) % NPRIO));
+    executor_barrier(x);
+    int ok = out_of_order == 0;
+    for (int key = 0; key < KEYS; key++)
+        ok = ok && last[key] == PER_KEY;
+    executor_stop(x);
+    return report("same-key FIFO", ok);
+}
+
+// A barrier waits for every job submitted before it, in every shard.
+static int check_barrier(void) {
+    Executor *x = executor_start(THREADS);
+    if (!x) return report("barrier", 0);
+    memset(last, 0, sizeof(last));
+    out_of_order = 0;
+    done = 0;
+    int ok = 1;
+    for (int round = 0; round < 20; round++) {
+        for (int key = 0; key < KEYS; key++)
+            for (int i = 1; i <= 5; i++)
+                submit_step(x, key, round * 5 + i, PRIO_BULK);
+        executor_barrier(x);
+        pthread_mutex_lock(&lock);
+        if (done != (long)(round + 1) * KEYS * 5)
+            ok = 0;
+        pthread_mutex_unlock(&lock);
+    }
+    executor_stop(x);
+    return report("barrier", ok && out_of_order == 0);
+}
+
+// With one thread held busy, what is queued behind it runs urgent jobs
+// first, except one submitted on the key of a pending bulk job.
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_open = PTHREAD_COND_INITIALIZER;
+static int gate, order[4], norder;
+
+static void wait_gate(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&gate_lock);
+    while (!gate)
+        pthread_cond_wait(&gate_open, &gate_lock);
+    pthread_mutex_unlock(&gate_lock);
+}
+
+static void record(void *arg) {
+    pthread_mutex_lock(&lock);
+    order[norder++] = *(int *)arg;
+    pthread_mutex_unlock(&lock);
+}
+
+static int check_priority(void) {
+    static int ids[4] = {0, 1, 2, 3};
+    Executor *x = executor_start(1);
+    if (!x) return report("priority", 0);
+    executor_submit(x, "gate", PRIO_URGENT, wait_gate, NULL);
+    executor_submit(x, "a", PRIO_BULK, record, &ids[0]);
+    executor_submit(x, "b", PRIO_URGENT, record, &ids[1]);
+    executor_submit(x, "a", PRIO_URGENT, record, &ids[2]);
+    executor_submit(x, "c", PRIO_NORMAL, record, &ids[3]);
+    pthread_mutex_lock(&gate_lock);
+    gate = 1;
+    pthread_cond_broadcast(&gate_open);
+    pthread_mutex_unlock(&gate_lock);
+    executor_barrier(x);
+    executor_stop(x);
+    // b is urgent; the urgent job on a waits behind the bulk one.
+    int ok = norder == 4 && order[0] == 1 && order[1] == 3 &&
+             order[2] == 0 && order[3] == 2;
+    return report("priority", ok);
+}
+
+int main(void) {
+    srand(1);
+    int bad = check_fifo();
+    bad += check_barrier();
+    bad += check_priority();
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,58 @@
+#!/bin/bash
+# Differential check of the parallel executor: the same 600 random
+# operations (appends, deletes, renames into other directories, new and
+# removed directories, rewritten large files) are run against the source
+# with each option set, and the target must end up identical to it.
+# Prints one "Parallel <options>: PASS" line per run, like test_backup.sh.
+
+PWD=$(pwd)
+rm -rf psource ptarget pipe parallel.log
+
+run() {
+    rm -rf psource ptarget
+    for d in $(seq 1 20); do
+        mkdir -p psource/d$d/sub
+        for f in $(seq 1 10); do echo $d$f > psource/d$d/f$f; done
+    done
+
+    mkfifo pipe
+    ./backup < pipe > parallel.log 2>&1 &
+    BACKUP_PID=$!
+    exec 3>pipe
+    echo "add $1 $PWD/psource $PWD/ptarget" >&3
+    sleep 1
+
+    # A fixed seed, so a failure can be replayed.
+    RANDOM=7
+    for i in $(seq 1 600); do
+        d=$((RANDOM % 20 + 1)); f=$((RANDOM % 12 + 1))
+        case $((RANDOM % 8)) in
+        0|1|2) echo "$i" >> psource/d$d/f$f ;;
+        3) rm -f psource/d$d/f$f ;;
+        4) [ -e psource/d$d/f$f ] &&
+               mv psource/d$d/f$f psource/d$((RANDOM % 20 + 1))/sub/m$i ;;
+        5) mkdir -p psource/d$d/n$i && echo x > psource/d$d/n$i/g ;;
+        6) rm -rf psource/d$d/n* ;;
+        7) head -c $((RANDOM * 8)) /dev/urandom > psource/d$d/sub/big$f ;;
+        esac
+    done
+    sleep 4
+
+    if diff -r -x .backup-meta psource ptarget > /dev/null; then
+        echo "Parallel ${1:-serial}: PASS"
+    else
+        echo "Parallel ${1:-serial}: FAIL"
+        diff -r -x .backup-meta psource ptarget | head -5
+    fi
+
+    echo "exit" >&3
+    wait $BACKUP_PID
+    exec 3>&-
+    rm -f pipe
+}
+
+run ""
+run "-a 4"
+run "-a 8"
+
+rm -rf psource ptarget pipe parallel.log
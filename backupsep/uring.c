@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include "uring.h"
+#include "manifest.h"
+
+// Batched small-file copier on a raw io_uring (no liburing). Files are
+// queued with uring_batch_add and copied URING_DEPTH at a time in four
+// rounds: openat(src) + statx + openat(dst), read, write, close. Each
+// round is one io_uring_enter for the whole batch instead of several
+// syscalls per file. Anything that does not fit the fast path (large
+// files, short writes, failed opens) is finished with the copy engine.
+// Small files are hashed from the buffer that was written, when the
+// manifest wants digests.
+//
+// If io_uring_enter fails mid-batch, whatever the kernel already took is
+// waited for before job memory is freed, only the files that were not
+// finished are redone, and the ring is not used again. A ring that
+// cannot even be drained may still open, truncate or write any file of
+// the batch: those files are reported and left alone, and what its
+// requests may point at is leaked rather than freed under them.
+
+#define URING_DEPTH   64
+#define URING_ENTRIES (URING_DEPTH * 3)
+
+enum {
+    OP_OPEN_IN, OP_STATX, OP_OPEN_OUT, OP_READ, OP_WRITE,
+    OP_CLOSE_IN, OP_CLOSE_OUT
+};
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned sq_entries;
+    unsigned tail;      // local SQ tail, published on submit
+    unsigned queued;    // SQEs queued since the last submit
+    unsigned inflight;  // submitted and not yet reaped
+} Ring;
+
+typedef struct {
+    char *src;
+    char *dst;
+    int in, out;
+    struct statx stx;
+    long long got, written;
+    int failed;
+    int copied;             // content and metadata are in place
+    FileDigest digest;      // len 0 when none was taken
+} UringJob;
+
+struct UringBatch {
+    Ring ring;
+    UringJob jobs[URING_DEPTH];
+    int count;
+    int broken;         // the ring failed; files go to the copy engine
+    int dead;           // and could not be drained
+    char *bufs;         // URING_DEPTH buffers of URING_SMALL_FILE bytes
+};
+
+static int ring_setup(Ring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) goto fail_sq;
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail_cq;
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->tail = *r->sq_tail;
+    return 0;
+
+fail_cq:
+    if (r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+fail_sq:
+    munmap(r->sq_ptr, r->sq_len);
+fail:
+    close(r->fd);
+    return -1;
+}
+
+static void ring_free(Ring *r) {
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+// The batch needs openat, statx, read, write and close (all 5.6+).
+static int ring_supports_ops(Ring *r) {
+    static const int need[] = {
+        IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+        IORING_OP_WRITE, IORING_OP_CLOSE
+    };
+    size_t len = sizeof(struct io_uring_probe) +
+                 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe) return 0;
+
+    int ok = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE,
+                     probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(need) / sizeof(need[0]); i++) {
+        if (need[i] > probe->last_op ||
+            !(probe->ops[need[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    }
+    free(probe);
+    return ok;
+}
+
+static unsigned ring_room(Ring *r) {
+    return r->sq_entries -
+           (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static struct io_uring_sqe *ring_sqe(Ring *r, int job, int op) {
+    if (ring_room(r) == 0)
+        return NULL;
+
+    unsigned idx = r->tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = ((unsigned long long)job << 8) | (unsigned)op;
+    r->sq_array[idx] = idx;
+    r->tail++;
+    r->queued++;
+    return sqe;
+}
+
+static void ring_reap(Ring *r, UringBatch *b,
+                      void (*done)(UringBatch *, int, int, int)) {
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, r->inflight--) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        done(b, (int)(cqe->user_data >> 8),
+             (int)(cqe->user_data & 0xff), cqe->res);
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Submits everything queued and waits for all of it to complete.
+static int ring_run(Ring *r, UringBatch *b,
+                    void (*done)(UringBatch *, int, int, int)) {
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+
+    while (r->queued > 0 || r->inflight > 0) {
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, r->queued,
+                             1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        r->queued -= n;
+        r->inflight += n;
+        ring_reap(r, b, done);
+    }
+    return 0;
+}
+
+// After a failed ring_run: waits out what the kernel took, without
+// submitting more. Returns -1 if even that fails for good.
+static int ring_drain(Ring *r, UringBatch *b,
+                      void (*done)(UringBatch *, int, int, int)) {
+    while (r->inflight > 0) {
+        ring_reap(r, b, done);
+        if (r->inflight == 0)
+            break;
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, 0, 1,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return -1;
+    }
+    return 0;
+}
+
+static void on_complete(UringBatch *b, int job, int op, int res) {
+    UringJob *j = &b->jobs[job];
+    // A failed close still releases the descriptor.
+    if (op == OP_CLOSE_IN) {
+        j->in = -1;
+        return;
+    }
+    if (op == OP_CLOSE_OUT) {
+        j->out = -1;
+        return;
+    }
+    if (res < 0) {
+        j->failed = 1;
+        return;
+    }
+    switch (op) {
+    case OP_OPEN_IN:  j->in = res; break;
+    case OP_OPEN_OUT: j->out = res; break;
+    case OP_READ:     j->got = res; break;
+    case OP_WRITE:    j->written = res; break;
+    default: break;
+    }
+}
+
+// Runs what is queued. On failure drains the ring and retires it.
+// Returns whether the batch is broken.
+static int run_round(UringBatch *b) {
+    Ring *r = &b->ring;
+    if (!r->queued)
+        return 0;
+    if (ring_run(r, b, on_complete) == 0)
+        return 0;
+    perror("io_uring_enter");
+    b->broken = 1;
+    if (ring_drain(r, b, on_complete) < 0)
+        b->dead = 1;
+    return 1;
+}
+
+UringBatch *uring_batch_new(void) {
+    UringBatch *b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+
+    if (ring_setup(&b->ring, URING_ENTRIES) < 0) {
+        free(b);
+        return NULL;
+    }
+    if (!ring_supports_ops(&b->ring) ||
+        !(b->bufs = malloc((size_t)URING_DEPTH * URING_SMALL_FILE))) {
+        ring_free(&b->ring);
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+void uring_batch_add(UringBatch *b, const char *src, const char *dst,
+                     CopyResult *res) {
+    if (b->broken) {
+        if (copy_file(src, dst, res) == 0)
+            manifest_record(dst);
+        return;
+    }
+    UringJob *j = &b->jobs[b->count];
+    j->src = strdup(src);
+    j->dst = strdup(dst);
+    if (!j->src || !j->dst) {
+        free(j->src);
+        free(j->dst);
+        copy_file(src, dst, res);
+        return;
+    }
+    if (++b->count == URING_DEPTH)
+        uring_batch_flush(b, res);
+}
+
+void uring_batch_flush(UringBatch *b, CopyResult *res) {
+    Ring *r = &b->ring;
+    if (b->count == 0) return;
+    HashAlgo algo;
+    int hashing = manifest_copy_algo(&algo);
+
+    // Round 1: open both ends and stat the source.
+    for (int i = 0; i < b->count; i++) {
+        UringJob *j = &b->jobs[i];
+        j->in = j->out = -1;
+        j->got = j->written = 0;
+        j->failed = j->copied = 0;
+        memset(&j->digest, 0, sizeof(j->digest));
+        if (ring_room(r) < 3) {
+            j->failed = 1;
+            continue;
+        }
+
+        struct io_uring_sqe *sqe = ring_sqe(r, i, OP_OPEN_IN);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)j->src;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+        sqe = ring_sqe(r, i, OP_STATX);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)j->src;
+        sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE |
+                   STATX_ATIME | STATX_MTIME;
+        sqe->off = (unsigned long)&j->stx;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+
+        sqe = ring_sqe(r, i, OP_OPEN_OUT);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)j->dst;
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        sqe->len = 0666;
+    }
+    int broken = run_round(b);
+
+    // Round 2: read small files whole; large ones go to the copy engine.
+    for (int i = 0; !broken && i < b->count; i++) {
+        UringJob *j = &b->jobs[i];
+        if (j->failed || !S_ISREG(j->stx.stx_mode)) {
+            j->failed = 1;
+            continue;
+        }
+        if (j->stx.stx_size > URING_SMALL_FILE) {
+            int rc = hashing
+                   ? copy_fd_hashed(j->in, j->out, res, algo, &j->digest)
+                   : copy_fd(j->in, j->out, res);
+            if (rc < 0)
+                j->failed = 1;
+            else
+                j->copied = 1;
+            continue;
+        }
+        if (j->stx.stx_size == 0)
+            continue;
+
+        struct io_uring_sqe *sqe = ring_sqe(r, i, OP_READ);
+        if (!sqe) {
+            j->failed = 1;
+            continue;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = j->in;
+        sqe->addr = (unsigned long)(b->bufs + (size_t)i * URING_SMALL_FILE);
+        sqe->len = URING_SMALL_FILE;
+        sqe->off = 0;
+    }
+    if (!broken) broken = run_round(b);
+
+    // Round 3: write back what was read.
+    for (int i = 0; !broken && i < b->count; i++) {
+        UringJob *j = &b->jobs[i];
+        if (j->failed || j->got <= 0) continue;
+
+        struct io_uring_sqe *sqe = ring_sqe(r, i, OP_WRITE);
+        if (!sqe) {
+            j->failed = 1;
+            continue;
+        }
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = j->out;
+        sqe->addr = (unsigned long)(b->bufs + (size_t)i * URING_SMALL_FILE);
+        sqe->len = (unsigned)j->got;
+        sqe->off = 0;
+    }
+    if (!broken) broken = run_round(b);
+
+    // Short writes are finished synchronously, then the metadata from
+    // round 1 is applied (there are no fchmod/futimens ring ops).
+    for (int i = 0; !broken && i < b->count; i++) {
+        UringJob *j = &b->jobs[i];
+        if (j->failed || j->stx.stx_size > URING_SMALL_FILE)
+            continue;
+        if (res && j->got > 0) {
+            res->bytes += j->written;
+            res->method = COPY_URING;
+        }
+        if (j->written < j->got &&
+            copy_range(j->in, j->out, j->written,
+                       j->got - j->written, res) < 0) {
+            j->failed = 1;
+            continue;
+        }
+
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_mode = j->stx.stx_mode;
+        st.st_atim.tv_sec = j->stx.stx_atime.tv_sec;
+        st.st_atim.tv_nsec = j->stx.stx_atime.tv_nsec;
+        st.st_mtim.tv_sec = j->stx.stx_mtime.tv_sec;
+        st.st_mtim.tv_nsec = j->stx.stx_mtime.tv_nsec;
+        copy_metadata(j->in, j->out, &st);
+
+        // Only a whole-file read stands for the content written.
+        FileDigest *d = &j->digest;
+        if (hashing && j->got == (long long)j->stx.stx_size &&
+            file_digest_init(d, algo, j->got) == 0) {
+            file_digest_update(d, b->bufs + (size_t)i * URING_SMALL_FILE,
+                               j->got);
+            if (file_digest_final(d) < 0)
+                d->len = 0;
+        }
+        j->copied = 1;
+    }
+
+    // Round 4: close everything that was opened. Descriptors the ring
+    // does not get to are closed here afterwards.
+    for (int i = 0; !broken && i < b->count; i++) {
+        UringJob *j = &b->jobs[i];
+        int fds[2] = {j->in, j->out};
+        for (int k = 0; k < 2; k++) {
+            if (fds[k] < 0) continue;
+            struct io_uring_sqe *sqe =
+                ring_sqe(r, i, k ? OP_CLOSE_OUT : OP_CLOSE_IN);
+            if (!sqe) continue;
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fds[k];
+        }
+    }
+    if (!broken) broken = run_round(b);
+
+    // Files left unfinished are redone through the regular engine.
+    for (int i = 0; i < b->count; i++) {
+        UringJob *j = &b->jobs[i];
+        if (!b->dead) {
+            if (j->in >= 0) close(j->in);
+            if (j->out >= 0) close(j->out);
+        }
+        int ok = 1;
+        if (b->dead && (!j->copied || j->failed)) {
+            fprintf(stderr, "%s: left unfinished by io_uring\n", j->src);
+            ok = 0;
+        } else if (!j->copied || j->failed) {
+            j->digest.len = 0;
+            ok = copy_file(j->src, j->dst, res) == 0;
+            if (!ok)
+                perror(j->src);
+        }
+        if (ok)
+            manifest_record_digest(j->dst, &j->digest);
+        file_digest_free(&j->digest);
+        if (!b->dead) {
+            free(j->src);
+            free(j->dst);
+        }
+    }
+    b->count = 0;
+}
+
+void uring_batch_free(UringBatch *b) {
+    if (!b) return;
+    uring_batch_flush(b, NULL);
+    if (b->dead)
+        return;     // the kernel may still write to it
+    ring_free(&b->ring);
+    free(b->bufs);
+    free(b);
+}
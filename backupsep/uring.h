@@ -0,0 +1,17 @@
+#ifndef URING_H
+#define URING_H
+
+#include "copy.h"
+
+// Files up to this size are copied entirely through the ring.
+#define URING_SMALL_FILE (64 << 10)
+
+typedef struct UringBatch UringBatch;
+
+UringBatch *uring_batch_new(void);
+void uring_batch_add(UringBatch *b, const char *src, const char *dst,
+                     CopyResult *res);
+void uring_batch_flush(UringBatch *b, CopyResult *res);
+void uring_batch_free(UringBatch *b);
+
+#endif
@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,10 +6,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
-#include <openssl/sha.h>
 #include "utils.h"
+#include "publish.h"
+#include "walk.h"
+#include "manifest.h"
+#include "merkle.h"
 
 char *real_path(const char *path, char *out) {
     if (!realpath(path, out)) {
@@ -19,6 +23,36 @@ char *real_path(const char *path, char *out) {
     return out;
 }
 
+// As real_path, for a path that may not exist yet; its parent must.
+char *real_new_path(const char *path, char *out) {
+    char dir[PATH_MAX];
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    if (len >= sizeof(dir)) {
+        fprintf(stderr, "realpath: %s: name too long\n", path);
+        return NULL;
+    }
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+
+    char *slash = strrchr(dir, '/');
+    char base[PATH_MAX];
+    strcpy(base, slash ? slash + 1 : dir);
+    if (slash)
+        slash[slash == dir] = '\0';    // keep / itself
+    if (!real_path(slash ? dir : ".", out))
+        return NULL;
+    size_t n = strlen(out);
+    if (n + 1 + strlen(base) >= PATH_MAX) {
+        fprintf(stderr, "realpath: %s: name too long\n", path);
+        return NULL;
+    }
+    snprintf(out + n, PATH_MAX - n, "%s%s", out[n - 1] == '/' ? "" : "/",
+             base);
+    return out;
+}
+
 int dir_empty(const char *path) {
     DIR *d = opendir(path);
     if (!d) return -1;
@@ -40,160 +74,458 @@ int is_subpath(const char *parent, const char *child) {
            (child[len] == '/' || child[len] == '\0');
 }
 
-void copy_recursive(const char *src, const char *dst) {
-    struct stat st;
-    if (lstat(src, &st) < 0) {
-        perror("lstat");
+void copy_recursive(const char *src, const char *dst, CopyResult *res) {
+    copy_recursive_batch(src, dst, NULL, res);
+}
+
+typedef struct {
+    const char *dst;
+    UringBatch *ub;
+    CopyResult *res;
+} CopyWalk;
+
+static void copy_symlink(const WalkEntry *e, const char *dst, int replace) {
+    char buf[PATH_MAX];
+    ssize_t len = readlinkat(e->dirfd, e->name, buf, sizeof(buf) - 1);
+    if (len < 0) return;
+    buf[len] = '\0';
+    if (replace)
+        unlink(dst);
+    if (symlink(buf, dst) < 0 && !replace)
         return;
+
+    struct stat st;
+    if (fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        struct timespec ts[2] = {st.st_atim, st.st_mtim};
+        utimensat(AT_FDCWD, dst, ts, AT_SYMLINK_NOFOLLOW);
     }
+}
 
-    if (S_ISDIR(st.st_mode)) {
-        mkdir(dst, st.st_mode & 0777);
+// Gives a directory its source's mode and times. Done on the way back up,
+// since creating the children changes the directory's mtime.
+static void copy_dir_metadata(const WalkEntry *e, const char *dst) {
+    struct stat st;
+    if (fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return;
+    struct timespec ts[2] = {st.st_atim, st.st_mtim};
+    chmod(dst, st.st_mode & 07777);
+    utimensat(AT_FDCWD, dst, ts, 0);
+}
 
-        DIR *dir = opendir(src);
-        if (!dir) return;
+// Whether dst already holds src: the manifest is asked first, then size
+// and mtime are compared on disk (and the manifest told if it missed it).
+int copy_unchanged(const char *src, const char *dst) {
+    if (manifest_current(src, dst))
+        return 1;
+    if (!same_size_mtime(src, dst))
+        return 0;
+    manifest_record(dst);
+    return 1;
+}
 
-        struct dirent *e;
-        while ((e = readdir(dir))) {
-            if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
-                continue;
+static int is_meta_dir(const WalkEntry *e) {
+    return e->depth == 1 && e->type == DT_DIR && !strcmp(e->name, META_DIR);
+}
 
-            char s[PATH_MAX], t[PATH_MAX];
-            snprintf(s, sizeof(s), "%s/%s", src, e->d_name);
-            snprintf(t, sizeof(t), "%s/%s", dst, e->d_name);
-            copy_recursive(s, t);
-        }
-        closedir(dir);
+static int copy_visit(const WalkEntry *e, WalkEvent ev, void *arg) {
+    CopyWalk *w = arg;
+    char t[PATH_MAX];
+    if (copy_cancelled())
+        return -1;
+    if (is_meta_dir(e))
+        return WALK_SKIP;
+    if (walk_target(e, w->dst, t) < 0)
+        return WALK_CONTINUE;
+
+    if (ev == WALK_ENTER) {
+        // Owner rwx while populating; the real mode is set on leave.
+        struct stat st;
+        if (fstatat(e->dirfd, e->name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            mkdir(t, (st.st_mode & 0777) | S_IRWXU);
+    } else if (ev == WALK_LEAVE) {
+        // Files queued on a batch are not written yet; the caller fixes
+        // directory times once the batch is flushed.
+        if (!w->ub)
+            copy_dir_metadata(e, t);
+    } else if (e->type == DT_REG) {
+        if (copy_unchanged(e->path, t))
+            return WALK_CONTINUE; // unchanged since the last copy
+        if (w->ub)
+            uring_batch_add(w->ub, e->path, t, w->res);
+        else if (publish_copy(e->path, t, w->res, NULL) < 0 &&
+                 !copy_cancelled())
+            perror(e->path);
+    } else if (e->type == DT_LNK) {
+        copy_symlink(e, t, 0);
     }
-    else if (S_ISREG(st.st_mode)) {
-        FILE *in = fopen(src, "rb");
-        FILE *out = fopen(dst, "wb");
-        if (!in || !out) return;
+    return WALK_CONTINUE;
+}
 
-        char buf[8192];
-        size_t n;
-        while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
-            fwrite(buf, 1, n, out);
+// With a batch, regular files are queued for the io_uring engine; the
+// caller flushes the batch when done.
+void copy_recursive_batch(const char *src, const char *dst,
+                          UringBatch *ub, CopyResult *res) {
+    CopyWalk w = {dst, ub, res};
+    if (walk_tree(src, copy_visit, &w) < 0 && !copy_cancelled())
+        perror(src);
+}
 
-        fclose(in);
-        fclose(out);
-    }
-    else if (S_ISLNK(st.st_mode)) {
-        char linkbuf[PATH_MAX];
-        ssize_t len = readlink(src, linkbuf, sizeof(linkbuf) - 1);
-        if (len < 0) return;
-        linkbuf[len] = '\0';
-        symlink(linkbuf, dst);
-    }
+static int dir_metadata_visit(const WalkEntry *e, WalkEvent ev, void *arg) {
+    char t[PATH_MAX];
+    if (ev == WALK_LEAVE && walk_target(e, arg, t) == 0)
+        copy_dir_metadata(e, t);
+    return WALK_CONTINUE;
 }
 
-int file_hash(const char *path, unsigned char out[SHA256_DIGEST_LENGTH]) {
-    FILE *f = fopen(path, "rb");
-    if (!f) return -1;
+// Applies directory modes and times after a copy that did not set them
+// (parallel or batched copies, which finish directories out of order).
+void copy_dir_metadata_tree(const char *src, const char *dst) {
+    walk_tree(src, dir_metadata_visit, (void *)dst);
+}
 
-    SHA256_CTX ctx;
-    SHA256_Init(&ctx);
+#define HASH_READ (256 << 10)
 
-    char buf[8192];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
-        SHA256_Update(&ctx, buf, n);
+// Returns the digest length, or -1. Files of MERKLE_MIN or more get the
+// root of their chunk tree, hashed in parallel.
+int file_hash(const char *path, HashAlgo algo,
+              unsigned char out[HASH_MAX_DIGEST]) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
 
-    fclose(f);
-    SHA256_Final(out, &ctx);
-    return 0;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= MERKLE_MIN) {
+        MerkleTree t;
+        int len = -1;
+        if (merkle_build(fd, algo, NULL, &t) == 0) {
+            len = (int)t.digest_len;
+            memcpy(out, t.root, len);
+            merkle_free(&t);
+        }
+        close(fd);
+        return len;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    HashCtx ctx;
+    char *buf = malloc(HASH_READ);
+    if (!buf || hash_init(&ctx, algo) < 0) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+
+    ssize_t n;
+    while ((n = read(fd, buf, HASH_READ)) > 0)
+        hash_update(&ctx, buf, n);
+
+    size_t len = hash_final(&ctx, out);
+    free(buf);
+    close(fd);
+    return n < 0 ? -1 : (int)len;
 }
 
-int files_differ(const char *a, const char *b) {
-    unsigned char ha[SHA256_DIGEST_LENGTH];
-    unsigned char hb[SHA256_DIGEST_LENGTH];
+#define COMPARE_CHUNK (1 << 20)
+
+// Reads up to COMPARE_CHUNK bytes at off, short only at end of file.
+static ssize_t read_chunk(int fd, char *buf, off_t off) {
+    size_t got = 0;
+    while (got < COMPARE_CHUNK) {
+        ssize_t r = pread(fd, buf + got, COMPARE_CHUNK - got, off + got);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        got += r;
+    }
+    return (ssize_t)got;
+}
 
-    if (file_hash(a, ha) < 0 || file_hash(b, hb) < 0)
-        return 1;
+// Compares sizes, then contents in aligned chunks, stopping at the first
+// chunk that differs. Bytes read from both files are added to *examined.
+int files_differ(const char *a, const char *b, long long *examined) {
+    int fa = open(a, O_RDONLY | O_CLOEXEC);
+    int fb = open(b, O_RDONLY | O_CLOEXEC);
+    void *ba = NULL, *bb = NULL;
+    struct stat sa, sb;
+    int differ = 1;
+
+    if (fa < 0 || fb < 0 || fstat(fa, &sa) < 0 || fstat(fb, &sb) < 0 ||
+        sa.st_size != sb.st_size ||
+        posix_memalign(&ba, 4096, COMPARE_CHUNK) ||
+        posix_memalign(&bb, 4096, COMPARE_CHUNK))
+        goto done;
+    posix_fadvise(fa, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fb, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    differ = 0;
+    for (off_t off = 0; off < sa.st_size && !differ; ) {
+        ssize_t na = read_chunk(fa, ba, off);
+        ssize_t nb = read_chunk(fb, bb, off);
+        if (examined)
+            *examined += (na > 0 ? na : 0) + (nb > 0 ? nb : 0);
+        differ = na <= 0 || na != nb || memcmp(ba, bb, na) != 0;
+        off += na > 0 ? na : 0;
+    }
 
-    return memcmp(ha, hb, SHA256_DIGEST_LENGTH) != 0;
+done:
+    free(ba);
+    free(bb);
+    if (fa >= 0) close(fa);
+    if (fb >= 0) close(fb);
+    return differ;
 }
 
-void restore_copy(const char *src, const char *dst) {
+typedef struct {
+    const char *src, *dst;
+    CopyResult *res;
+    int paranoid;       // compare contents instead of size and mtime
+    ManifestView *manifest;
+    long long examined; // bytes read to compare contents
+} RestoreWalk;
+
+// Brings a large file in line with its backup using the chunk digests
+// stored for the backup: only t is read, and only the chunks that differ
+// are copied. Returns -1 to fall back to a whole-file copy.
+static int restore_chunks(RestoreWalk *w, const WalkEntry *e, const char *t,
+                          const ManifestEntry *me) {
+    char side[PATH_MAX];
+    MerkleTree bt, tt;
+    if (manifest_chunks_path(w->src, e->path + e->root_len, side) < 0 ||
+        merkle_load(side, &bt) < 0)
+        return -1;
+
+    int rc = -1, in = -1, out = -1;
+    if (bt.ino != me->ino || bt.size != me->size ||
+        bt.mtime_ns != me->mtime_ns || bt.digest_len != me->hash_len ||
+        memcmp(bt.root, me->hash, me->hash_len))
+        goto done;
+    out = open_target(t, O_RDWR | O_CLOEXEC, 0);
+    in = open(e->path, O_RDONLY | O_CLOEXEC);
+    if (out < 0 || in < 0 || merkle_build(out, bt.algo, NULL, &tt) < 0)
+        goto done;
+    w->examined += tt.size;
+
+    rc = 0;
+    uint64_t next = 0;
+    long long first;
+    while (rc == 0 && (first = merkle_diff(&bt, &tt, next, &next)) >= 0) {
+        long long off = first * MERKLE_CHUNK, end = next * MERKLE_CHUNK;
+        if (end > bt.size) end = bt.size;
+        if (off < end && copy_range(in, out, off, end - off, w->res) < 0)
+            rc = -1;
+    }
     struct stat st;
-    if (lstat(src, &st) < 0) return;
-
-    if (S_ISDIR(st.st_mode)) {
-        mkdir(dst, 0755);
+    if (rc == 0 && (ftruncate(out, bt.size) < 0 || fstat(in, &st) < 0))
+        rc = -1;
+    if (rc == 0)
+        copy_metadata(in, out, &st);
+    merkle_free(&tt);
+done:
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    merkle_free(&bt);
+    return rc;
+}
 
-        DIR *d = opendir(src);
-        if (!d) return;
+// Paranoid check of a restore target against the backup copy. A digest
+// recorded for an untouched backup file saves hashing it again.
+static int restore_unchanged(RestoreWalk *w, const WalkEntry *e,
+                             const char *t) {
+    if (!w->paranoid)
+        return same_size_mtime(e->path, t);
+
+    ManifestEntry me;
+    struct stat ts, bs;
+    if (lstat(t, &ts) < 0 || !S_ISREG(ts.st_mode))
+        return 0;
+    int known = w->manifest &&
+        manifest_find(w->manifest, e->path + e->root_len, &me) == 0 &&
+        me.hash_len && lstat(e->path, &bs) == 0 &&
+        manifest_entry_matches(&me, &bs);
+
+    if (known && me.size >= MERKLE_MIN && restore_chunks(w, e, t, &me) == 0)
+        return 1;
+    if (known && ts.st_size == me.size) {
+        unsigned char h[HASH_MAX_DIGEST];
+        int n = file_hash(t, (HashAlgo)me.hash_algo, h);
+        w->examined += me.size;
+        return n == me.hash_len && !memcmp(h, me.hash, n);
+    }
+    return !files_differ(e->path, t, &w->examined);
+}
 
-        struct dirent *e;
-        while ((e = readdir(d))) {
-            if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
-                continue;
+static int restore_visit(const WalkEntry *e, WalkEvent ev, void *arg) {
+    RestoreWalk *w = arg;
+    char t[PATH_MAX];
+    if (is_meta_dir(e))
+        return WALK_SKIP;
+    if (walk_target(e, w->dst, t) < 0)
+        return WALK_CONTINUE;
+
+    if (ev == WALK_ENTER) {
+        mkdir(t, 0755);
+    } else if (ev == WALK_LEAVE) {
+        copy_dir_metadata(e, t);
+    } else if (e->type == DT_REG) {
+        if (restore_unchanged(w, e, t))
+            return WALK_CONTINUE; // unchanged
+
+        if (copy_file(e->path, t, w->res) < 0)
+            perror(e->path);
+    } else if (e->type == DT_LNK) {
+        copy_symlink(e, t, 1);
+    }
+    return WALK_CONTINUE;
+}
 
-            char s[PATH_MAX], t[PATH_MAX];
-            snprintf(s, sizeof(s), "%s/%s", src, e->d_name);
-            snprintf(t, sizeof(t), "%s/%s", dst, e->d_name);
+// Returns the number of bytes read to compare contents.
+long long restore_copy(const char *src, const char *dst, CopyResult *res,
+                       int paranoid) {
+    RestoreWalk w = {src, dst, res, paranoid, NULL, 0};
+    if (paranoid)
+        w.manifest = manifest_load(src);
+    walk_tree(src, restore_visit, &w);
+    manifest_view_free(w.manifest);
+    return w.examined;
+}
 
-            restore_copy(s, t);
+typedef struct {
+    const char *ref;
+    int orphan_depth;   // depth of the topmost entry missing from ref, or -1
+    int forget;         // also drop what is removed from the manifest
+} CleanupWalk;
+
+// Removes everything under src that has no counterpart under ref.
+// Directories are removed on the way back up, once they are empty.
+static int cleanup_visit(const WalkEntry *e, WalkEvent ev, void *arg) {
+    CleanupWalk *w = arg;
+    if (e->depth == 0)
+        return WALK_CONTINUE;
+    if (is_meta_dir(e))
+        return WALK_SKIP;
+
+    if (ev != WALK_LEAVE && w->orphan_depth < 0) {
+        char r[PATH_MAX];
+        if (walk_target(e, w->ref, r) == 0 && access(r, F_OK) != 0) {
+            w->orphan_depth = e->depth;
+            if (w->forget)
+                manifest_forget(e->path, e->type == DT_DIR);
         }
-        closedir(d);
     }
-    else if (S_ISREG(st.st_mode)) {
-        if (access(dst, F_OK) == 0 && !files_differ(src, dst))
-            return; // unchanged
+    if (w->orphan_depth < 0)
+        return WALK_CONTINUE;
+
+    if (ev == WALK_FILE) {
+        unlinkat(e->dirfd, e->name, 0);
+        if (e->depth == w->orphan_depth)
+            w->orphan_depth = -1;
+    } else if (ev == WALK_LEAVE) {
+        unlinkat(e->dirfd, e->name, AT_REMOVEDIR);
+        if (e->depth == w->orphan_depth)
+            w->orphan_depth = -1;
+    }
+    return WALK_CONTINUE;
+}
 
-        FILE *in = fopen(src, "rb");
-        FILE *out = fopen(dst, "wb");
-        if (!in || !out) return;
+void restore_cleanup(const char *src, const char *ref) {
+    CleanupWalk w = {ref, -1, 0};
+    walk_tree(src, cleanup_visit, &w);
+}
 
-        char buf[8192];
-        size_t n;
-        while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
-            fwrite(buf, 1, n, out);
+// Removes what a resumed target still holds of files deleted from the
+// source while no backup was running.
+void prune_target(const char *dst, const char *src) {
+    CleanupWalk w = {src, -1, 1};
+    walk_tree(dst, cleanup_visit, &w);
+}
 
-        fclose(in);
-        fclose(out);
-    }
-    else if (S_ISLNK(st.st_mode)) {
-        char buf[PATH_MAX];
-        ssize_t len = readlink(src, buf, sizeof(buf)-1);
-        if (len < 0) return;
-        buf[len] = 0;
+static int remove_visit(const WalkEntry *e, WalkEvent ev, void *arg) {
+    (void)arg;
+    if (ev == WALK_FILE)
+        unlinkat(e->dirfd, e->name, 0);
+    else if (ev == WALK_LEAVE)
+        unlinkat(e->dirfd, e->name, AT_REMOVEDIR);
+    return WALK_CONTINUE;
+}
 
-        unlink(dst);
-        symlink(buf, dst);
-    }
+// Removes path, and everything in it if it is a directory.
+void remove_tree(const char *path) {
+    if (unlink(path) == 0 || (errno != EISDIR && errno != EPERM))
+        return;
+    walk_tree(path, remove_visit, NULL);
 }
 
-void restore_cleanup(const char *src, const char *ref) {
-    DIR *d = opendir(src);
-    if (!d) return;
+typedef struct {
+    const char *src, *dst;
+    VerifyResult *res;
+} VerifyWalk;
 
-    struct dirent *e;
-    while ((e = readdir(d))) {
-        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
-            continue;
-
-        char s[PATH_MAX], r[PATH_MAX];
-        snprintf(s, sizeof(s), "%s/%s", src, e->d_name);
-        snprintf(r, sizeof(r), "%s/%s", ref, e->d_name);
-
-        if (access(r, F_OK) != 0) {
-            struct stat st;
-            lstat(s, &st);
-            if (S_ISDIR(st.st_mode)) {
-                restore_cleanup(s, r);
-                rmdir(s);
-            } else {
-                unlink(s);
-            }
-        } else {
-            struct stat st;
-            lstat(s, &st);
-            if (S_ISDIR(st.st_mode))
-                restore_cleanup(s, r);
+// Lists the byte ranges of t that no longer match the stored chunks.
+static void report_chunks(const char *root, const char *rel, const char *t) {
+    char side[PATH_MAX];
+    MerkleTree bt, tt;
+    if (manifest_chunks_path(root, rel, side) < 0 || merkle_load(side, &bt) < 0)
+        return;
+    int fd = open(t, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && merkle_build(fd, bt.algo, NULL, &tt) == 0) {
+        uint64_t next = 0;
+        long long first;
+        while ((first = merkle_diff(&bt, &tt, next, &next)) >= 0)
+            printf("  bytes %lld-%lld\n", first * MERKLE_CHUNK,
+                   (long long)next * MERKLE_CHUNK - 1);
+        merkle_free(&tt);
+    }
+    if (fd >= 0) close(fd);
+    merkle_free(&bt);
+}
+
+static void verify_entry(const char *rel, const ManifestEntry *e, void *arg) {
+    VerifyWalk *w = arg;
+    char s[PATH_MAX], t[PATH_MAX];
+    struct stat st;
+    snprintf(s, sizeof(s), "%s%s", w->src, rel);
+    snprintf(t, sizeof(t), "%s%s", w->dst, rel);
+    w->res->files++;
+
+    // The backup copy first: changed behind our back, or bit rot.
+    if (lstat(t, &st) < 0 || !manifest_entry_matches(e, &st)) {
+        printf("changed: %s\n", rel);
+        w->res->changed++;
+        return;
+    }
+    if (!e->hash_len) {
+        w->res->unhashed++;
+    } else {
+        unsigned char h[HASH_MAX_DIGEST];
+        int n = file_hash(t, (HashAlgo)e->hash_algo, h);
+        if (n != e->hash_len || memcmp(h, e->hash, n)) {
+            printf("corrupt: %s\n", rel);
+            if (e->size >= MERKLE_MIN)
+                report_chunks(w->dst, rel, t);
+            w->res->corrupt++;
+            return;
         }
     }
-    closedir(d);
+
+    // Then whether the source has moved on since it was replicated.
+    if (lstat(s, &st) < 0 || st.st_size != e->size ||
+        (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec !=
+            e->mtime_ns) {
+        printf("stale: %s\n", rel);
+        w->res->stale++;
+        return;
+    }
+    w->res->ok++;
+}
+
+// Checks every file the manifest of dst knows about, without walking
+// either tree. Returns -1 if dst has no manifest.
+int verify_backup(const char *src, const char *dst, VerifyResult *res) {
+    ManifestView *m = manifest_load(dst);
+    if (!m) return -1;
+    VerifyWalk w = {src, dst, res};
+    manifest_each(m, verify_entry, &w);
+    manifest_view_free(m);
+    return 0;
 }
 
 void map_path(const char *src, const char *source,
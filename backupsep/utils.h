@@ -1,17 +1,38 @@
 #ifndef UTILS_H
 #define UTILS_H
 
-#include <openssl/sha.h>
 #include <limits.h>
+#include "copy.h"
+#include "uring.h"
+#include "hash.h"
 
 char *real_path(const char *path, char *out);
+char *real_new_path(const char *path, char *out);
 int dir_empty(const char *path);
 int is_subpath(const char *parent, const char *child);
-void copy_recursive(const char *src, const char *dst);
-int file_hash(const char *path, unsigned char out[SHA256_DIGEST_LENGTH]);
-int files_differ(const char *a, const char *b);
-void restore_copy(const char *src, const char *dst);
+void copy_recursive(const char *src, const char *dst, CopyResult *res);
+void copy_recursive_batch(const char *src, const char *dst,
+                          UringBatch *ub, CopyResult *res);
+void copy_dir_metadata_tree(const char *src, const char *dst);
+int copy_unchanged(const char *src, const char *dst);
+int file_hash(const char *path, HashAlgo algo,
+              unsigned char out[HASH_MAX_DIGEST]);
+int files_differ(const char *a, const char *b, long long *examined);
+long long restore_copy(const char *src, const char *dst, CopyResult *res,
+                       int paranoid);
 void restore_cleanup(const char *src, const char *ref);
+void prune_target(const char *dst, const char *src);
+void remove_tree(const char *path);
+
+typedef struct {
+    long files, ok;
+    long changed;       // backup copy no longer what was written
+    long corrupt;       // same metadata, different content
+    long stale;         // source changed since replication
+    long unhashed;      // not hashed yet, content not checked
+} VerifyResult;
+
+int verify_backup(const char *src, const char *dst, VerifyResult *res);
 void map_path(const char *src, const char *source, const char *target, char *out);
 
 #endif
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <errno.h>
+#include "walk.h"
+
+// Non-recursive tree walker. Each open directory is one frame on an
+// explicit stack holding its fd and a getdents64 buffer; entries are
+// opened and stat'ed relative to that fd, and their type comes from
+// d_type (fstatat is only needed on filesystems that report DT_UNKNOWN).
+// The full path is kept in a single buffer that grows and shrinks as the
+// walk descends and returns, so memory is bounded by tree depth.
+//
+// Only the deepest WALK_OPEN directories keep their fd, so a deep tree
+// leaves fds for the callbacks; the ones above are parked: their fd is
+// closed after noting the read position, and they are reopened by path
+// and read on from there once the walk is back. Running out of fds
+// anyway parks more of them. A directory that cannot be opened even so
+// is reported and skipped.
+
+#define WALK_BUF (32 << 10)
+#define WALK_OPEN 16
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+typedef struct {
+    int fd;             // -1 while parked
+    off_t resume;       // read position of a parked directory
+    char *buf;          // getdents64 buffer, kept for reuse at this depth
+    int pos, len;
+    size_t path_len;    // length of this directory's path
+    size_t name_off;    // offset of its name within the path
+} Frame;
+
+static unsigned char mode_to_type(mode_t m) {
+    if (S_ISDIR(m)) return DT_DIR;
+    if (S_ISREG(m)) return DT_REG;
+    if (S_ISLNK(m)) return DT_LNK;
+    if (S_ISFIFO(m)) return DT_FIFO;
+    if (S_ISSOCK(m)) return DT_SOCK;
+    if (S_ISCHR(m)) return DT_CHR;
+    if (S_ISBLK(m)) return DT_BLK;
+    return DT_UNKNOWN;
+}
+
+static int push(Frame **stack, int *cap, int depth, int fd,
+                size_t path_len, size_t name_off) {
+    if (depth == *cap) {
+        int ncap = *cap ? *cap * 2 : 16;
+        Frame *n = realloc(*stack, ncap * sizeof(*n));
+        if (!n) return -1;
+        memset(n + *cap, 0, (ncap - *cap) * sizeof(*n));
+        *stack = n;
+        *cap = ncap;
+    }
+    Frame *f = &(*stack)[depth];
+    if (!f->buf && !(f->buf = malloc(WALK_BUF)))
+        return -1;
+    f->fd = fd;
+    f->pos = f->len = 0;
+    f->path_len = path_len;
+    f->name_off = name_off;
+    return 0;
+}
+
+// Closes the fd of the shallowest open frame other than keep, to free an
+// fd for the caller.
+static int park(Frame *stack, int depth, int keep) {
+    for (int i = 0; i < depth; i++) {
+        Frame *f = &stack[i];
+        if (i == keep || f->fd < 0 ||
+            (f->resume = lseek(f->fd, 0, SEEK_CUR)) < 0)
+            continue;
+        close(f->fd);
+        f->fd = -1;
+        return 0;
+    }
+    return -1;
+}
+
+// openat that parks ancestors, but not frame keep, while out of fds.
+static int open_dir(Frame *stack, int depth, int keep, int dirfd,
+                    const char *name, int flags) {
+    int fd;
+    while ((fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+                                     flags)) < 0 &&
+           (errno == EMFILE || errno == ENFILE) &&
+           park(stack, depth, keep) == 0)
+        ;
+    return fd;
+}
+
+// Reopens frame i if it was parked. path holds at least its path.
+static int unpark(Frame *stack, int depth, int i, char *path) {
+    Frame *f = &stack[i];
+    if (f->fd >= 0)
+        return 0;
+    char c = path[f->path_len];
+    path[f->path_len] = '\0';
+    f->fd = open_dir(stack, depth, depth - 1, AT_FDCWD, path,
+                     i > 0 ? O_NOFOLLOW : 0);
+    if (f->fd >= 0 && lseek(f->fd, f->resume, SEEK_SET) < 0) {
+        close(f->fd);
+        f->fd = -1;
+    }
+    if (f->fd < 0)
+        perror(path);
+    path[f->path_len] = c;
+    return f->fd < 0 ? -1 : 0;
+}
+
+// The path of e with its root replaced by root.
+int walk_target(const WalkEntry *e, const char *root, char *out) {
+    int n = snprintf(out, PATH_MAX, "%s%s", root, e->path + e->root_len);
+    return n < 0 || n >= PATH_MAX ? -1 : 0;
+}
+
+int walk_tree(const char *root, WalkFn fn, void *arg) {
+    char path[PATH_MAX];
+    size_t root_len = strlen(root);
+    if (root_len >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(path, root, root_len + 1);
+
+    struct stat st;
+    if (fstatat(AT_FDCWD, root, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        return -1;
+
+    WalkEntry e;
+    e.dirfd = AT_FDCWD;
+    e.name = path;
+    e.path = path;
+    e.root_len = root_len;
+    e.type = mode_to_type(st.st_mode);
+    e.depth = 0;
+
+    if (e.type != DT_DIR)
+        return fn(&e, WALK_FILE, arg) < 0 ? -1 : 0;
+
+    int rc = fn(&e, WALK_ENTER, arg);
+    if (rc != WALK_CONTINUE)
+        return rc < 0 ? -1 : 0;
+
+    Frame *stack = NULL;
+    int cap = 0, depth = 0;
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || push(&stack, &cap, 0, fd, root_len, 0) < 0) {
+        if (fd >= 0) close(fd);
+        else perror(root);
+        rc = fn(&e, WALK_LEAVE, arg);
+        free(stack);
+        return rc < 0 ? -1 : 0;
+    }
+    depth = 1;
+    rc = 0;
+
+    while (depth > 0 && rc >= 0) {
+        Frame *top = &stack[depth - 1];
+
+        if (top->pos >= top->len) {
+            long n = top->fd < 0 ? 0 :
+                     syscall(SYS_getdents64, top->fd, top->buf, WALK_BUF);
+            if (n > 0) {
+                top->pos = 0;
+                top->len = (int)n;
+                continue;
+            }
+
+            // Directory exhausted (or unreadable): leave it.
+            if (top->fd >= 0) close(top->fd);
+            top->fd = -1;
+            // Back to a parked parent: what is left of it is skipped if
+            // it cannot be reopened.
+            if (depth > 1 && unpark(stack, depth, depth - 2, path) < 0)
+                stack[depth - 2].pos = stack[depth - 2].len;
+            path[top->path_len] = '\0';
+            e.dirfd = depth > 1 ? stack[depth - 2].fd : AT_FDCWD;
+            e.name = path + top->name_off;
+            e.type = DT_DIR;
+            e.depth = depth - 1;
+            rc = fn(&e, WALK_LEAVE, arg);
+            depth--;
+            if (depth > 0)
+                path[stack[depth - 1].path_len] = '\0';
+            continue;
+        }
+
+        struct linux_dirent64 *d =
+            (struct linux_dirent64 *)(top->buf + top->pos);
+        top->pos += d->d_reclen;
+        if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+            continue;
+
+        size_t name_len = strlen(d->d_name);
+        if (top->path_len + 1 + name_len >= sizeof(path)) {
+            fprintf(stderr, "Path too long: %s/%s\n", path, d->d_name);
+            continue;
+        }
+        path[top->path_len] = '/';
+        memcpy(path + top->path_len + 1, d->d_name, name_len + 1);
+
+        e.dirfd = top->fd;
+        e.name = path + top->path_len + 1;
+        e.depth = depth;
+        e.type = d->d_type;
+        if (e.type == DT_UNKNOWN) {
+            if (fstatat(top->fd, e.name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                path[top->path_len] = '\0';
+                continue;
+            }
+            e.type = mode_to_type(st.st_mode);
+        }
+
+        if (e.type != DT_DIR) {
+            rc = fn(&e, WALK_FILE, arg);
+            path[top->path_len] = '\0';
+            continue;
+        }
+
+        rc = fn(&e, WALK_ENTER, arg);
+        if (rc != WALK_CONTINUE) {
+            path[top->path_len] = '\0';
+            if (rc == WALK_SKIP) rc = 0;
+            continue;
+        }
+
+        size_t name_off = top->path_len + 1;
+        size_t path_len = name_off + name_len;
+        if (depth >= WALK_OPEN && stack[depth - WALK_OPEN].fd >= 0)
+            park(stack, depth, depth - 1);
+        fd = open_dir(stack, depth, depth - 1, top->fd, e.name, O_NOFOLLOW);
+        if (fd < 0 || push(&stack, &cap, depth, fd, path_len, name_off) < 0) {
+            if (fd >= 0) close(fd);
+            else if (errno != ENOENT) perror(path);
+            rc = fn(&e, WALK_LEAVE, arg);
+            path[name_off - 1] = '\0';
+            continue;
+        }
+        depth++;
+    }
+
+    // Aborted: close whatever is still open.
+    for (int i = 0; i < depth; i++)
+        if (stack[i].fd >= 0)
+            close(stack[i].fd);
+    for (int i = 0; i < cap; i++)
+        free(stack[i].buf);
+    free(stack);
+    return rc < 0 ? -1 : 0;
+}
@@ -0,0 +1,30 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <stddef.h>
+
+typedef enum {
+    WALK_ENTER,     // directory, before its children
+    WALK_FILE,      // anything that is not a directory
+    WALK_LEAVE      // directory, after its children
+} WalkEvent;
+
+// Callback results; anything negative aborts the walk.
+#define WALK_CONTINUE 0
+#define WALK_SKIP     1     // from WALK_ENTER: do not descend
+
+typedef struct {
+    int dirfd;              // containing directory (AT_FDCWD for the root)
+    const char *name;       // entry name relative to dirfd
+    const char *path;       // full path, root included
+    size_t root_len;        // path + root_len is the part below the root
+    unsigned char type;     // DT_* of the entry, never DT_UNKNOWN
+    int depth;              // 0 for the root
+} WalkEntry;
+
+typedef int (*WalkFn)(const WalkEntry *e, WalkEvent ev, void *arg);
+
+int walk_tree(const char *root, WalkFn fn, void *arg);
+int walk_target(const WalkEntry *e, const char *root, char *out);
+
+#endif
@@ -2,82 +2,503 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/inotify.h>
 #include <limits.h>
+#include <errno.h>
 #include "watcher.h"
+#include "walk.h"
 
-#define MAX_WATCHES 1024
+// Watched directories form a tree of nodes, each holding its parent, its
+// first child, its siblings and its own name; the root node's name is
+// the whole root path. Nodes live
+// in one growable array and names in one arena, so a directory costs a
+// few dozen bytes instead of a PATH_MAX buffer, and moving a directory
+// re-points one node for its whole subtree. Full paths are built only
+// when asked for.
+//
+// Two open-addressing tables with linear probing index the nodes: by wd,
+// and by (parent, name). Removal shifts the rest of the probe run back,
+// so there are no tombstones and lookups stay constant time.
+
+#define INITIAL_SLOTS 256
+#define INITIAL_NODES 256
+#define NO_NODE UINT32_MAX
+
+typedef struct {
+    uint32_t parent;        // NO_NODE for a root
+    uint32_t name_off;      // into names
+    uint32_t name_len;
+    uint32_t children;      // live nodes with this one as parent
+    uint32_t child;         // first of them, or NO_NODE
+    uint32_t prev, next;    // siblings, or NO_NODE
+    int wd;                 // 0 while not watched (an interior directory)
+} Node;
 
 typedef struct {
-    int wd;
-    char path[PATH_MAX];
-} Watch;
+    uint32_t *slots;        // node index + 1, 0 = empty
+    size_t nslots;          // power of two
+    size_t count;
+} Index;
 
-static Watch watches[MAX_WATCHES];
-static int watch_count = 0;
+static Node *nodes;
+static uint32_t nnodes, nodes_cap;
+static uint32_t free_node = NO_NODE;    // chained through .parent
 
-void add_watch(int fd, const char *path) {
-    if (watch_count >= MAX_WATCHES) {
-        fprintf(stderr, "Error: Max watches reached\n");
+static uint32_t *roots;         // nodes without a parent, usually one
+static size_t nroots, roots_cap;
+
+static char *names;
+static size_t names_len, names_cap, names_dead;
+
+static Index by_wd, by_name;
+
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint64_t name_hash(uint32_t parent, const char *name, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ parent;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+    return mix(h);
+}
+
+static uint64_t node_hash(const Index *ix, uint32_t n) {
+    if (ix == &by_wd)
+        return mix((uint32_t)nodes[n].wd);
+    return name_hash(nodes[n].parent, names + nodes[n].name_off,
+                     nodes[n].name_len);
+}
+
+static void index_place(Index *ix, uint32_t n) {
+    size_t mask = ix->nslots - 1;
+    size_t i = node_hash(ix, n) & mask;
+    while (ix->slots[i])
+        i = (i + 1) & mask;
+    ix->slots[i] = n + 1;
+}
+
+// Keeps the index at most 3/4 full.
+static int index_reserve(Index *ix) {
+    if ((ix->count + 1) * 4 <= ix->nslots * 3)
+        return 0;
+
+    Index old = *ix;
+    size_t slots = old.nslots ? old.nslots * 2 : INITIAL_SLOTS;
+    uint32_t *n = calloc(slots, sizeof(*n));
+    if (!n) return -1;
+
+    ix->slots = n;
+    ix->nslots = slots;
+    for (size_t i = 0; i < old.nslots; i++)
+        if (old.slots[i])
+            index_place(ix, old.slots[i] - 1);
+    free(old.slots);
+    return 0;
+}
+
+static int index_add(Index *ix, uint32_t n) {
+    if (index_reserve(ix) < 0)
+        return -1;
+    index_place(ix, n);
+    ix->count++;
+    return 0;
+}
+
+static void index_remove(Index *ix, uint32_t n) {
+    size_t mask = ix->nslots - 1;
+    if (!ix->nslots) return;
+    size_t hole = node_hash(ix, n) & mask;
+    while (ix->slots[hole] && ix->slots[hole] != n + 1)
+        hole = (hole + 1) & mask;
+    if (!ix->slots[hole]) return;
+    ix->count--;
+
+    // Pull later members of the probe run into the gap, so every entry
+    // stays reachable from its home slot.
+    for (size_t i = (hole + 1) & mask; ix->slots[i]; i = (i + 1) & mask) {
+        size_t home = node_hash(ix, ix->slots[i] - 1) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            ix->slots[hole] = ix->slots[i];
+            hole = i;
+        }
+    }
+    ix->slots[hole] = 0;
+}
+
+static uint32_t find_wd(int wd) {
+    size_t mask = by_wd.nslots - 1;
+    if (!by_wd.nslots) return NO_NODE;
+    for (size_t i = mix((uint32_t)wd) & mask; by_wd.slots[i];
+         i = (i + 1) & mask)
+        if (nodes[by_wd.slots[i] - 1].wd == wd)
+            return by_wd.slots[i] - 1;
+    return NO_NODE;
+}
+
+static uint32_t find_child(uint32_t parent, const char *name, size_t len) {
+    size_t mask = by_name.nslots - 1;
+    if (!by_name.nslots) return NO_NODE;
+    for (size_t i = name_hash(parent, name, len) & mask; by_name.slots[i];
+         i = (i + 1) & mask) {
+        const Node *c = &nodes[by_name.slots[i] - 1];
+        if (c->parent == parent && c->name_len == len &&
+            !memcmp(names + c->name_off, name, len))
+            return by_name.slots[i] - 1;
+    }
+    return NO_NODE;
+}
+
+// Copies the live names into a fresh arena once most of it is garbage.
+static void compact_names(void) {
+    if (names_dead < (1 << 20) || names_dead < names_len / 2)
         return;
+    char *fresh = malloc(names_len - names_dead);
+    if (!fresh) return;
+
+    size_t len = 0;
+    for (uint32_t i = 0; i < nnodes; i++) {
+        if (!nodes[i].name_len) continue;
+        memcpy(fresh + len, names + nodes[i].name_off, nodes[i].name_len);
+        nodes[i].name_off = (uint32_t)len;
+        len += nodes[i].name_len;
     }
+    free(names);
+    names = fresh;
+    names_len = names_cap = len;
+    names_dead = 0;
+}
 
-    int wd = inotify_add_watch(fd, path,
-        IN_CREATE | IN_DELETE | IN_MODIFY |
-        IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF);
+static int set_name(uint32_t n, const char *name, size_t len) {
+    if (names_len + len > UINT32_MAX)
+        return -1;
+    if (names_len + len > names_cap) {
+        size_t cap = names_cap ? names_cap * 2 : 4096;
+        while (cap < names_len + len) cap *= 2;
+        char *p = realloc(names, cap);
+        if (!p) return -1;
+        names = p;
+        names_cap = cap;
+    }
+    names_dead += nodes[n].name_len;
+    memcpy(names + names_len, name, len);
+    nodes[n].name_off = (uint32_t)names_len;
+    nodes[n].name_len = (uint32_t)len;
+    names_len += len;
+    return 0;
+}
 
-    if (wd < 0) return;
+static int add_root(uint32_t n) {
+    if (nroots == roots_cap) {
+        size_t cap = roots_cap ? roots_cap * 2 : 4;
+        uint32_t *p = realloc(roots, cap * sizeof(*p));
+        if (!p) return -1;
+        roots = p;
+        roots_cap = cap;
+    }
+    roots[nroots++] = n;
+    return 0;
+}
 
-    watches[watch_count].wd = wd;
-    strncpy(watches[watch_count].path, path, PATH_MAX);
-    watch_count++;
+static void drop_root(uint32_t n) {
+    for (size_t i = 0; i < nroots; i++) {
+        if (roots[i] == n) {
+            roots[i] = roots[--nroots];
+            return;
+        }
+    }
 }
 
-void add_watches_recursive(int fd, const char *root) {
-    struct stat st;
-    if (lstat(root, &st) < 0 || !S_ISDIR(st.st_mode))
-        return;
+static void link_child(uint32_t parent, uint32_t n) {
+    nodes[n].prev = NO_NODE;
+    nodes[n].next = nodes[parent].child;
+    if (nodes[parent].child != NO_NODE)
+        nodes[nodes[parent].child].prev = n;
+    nodes[parent].child = n;
+    nodes[parent].children++;
+}
 
-    add_watch(fd, root);
+static void unlink_child(uint32_t n) {
+    uint32_t parent = nodes[n].parent;
+    if (nodes[n].prev != NO_NODE)
+        nodes[nodes[n].prev].next = nodes[n].next;
+    else
+        nodes[parent].child = nodes[n].next;
+    if (nodes[n].next != NO_NODE)
+        nodes[nodes[n].next].prev = nodes[n].prev;
+    nodes[parent].children--;
+}
+
+static uint32_t new_node(uint32_t parent, const char *name, size_t len) {
+    uint32_t n = free_node;
+    if (n != NO_NODE) {
+        free_node = nodes[n].parent;
+    } else {
+        if (nnodes == nodes_cap) {
+            uint32_t cap = nodes_cap ? nodes_cap * 2 : INITIAL_NODES;
+            Node *p = realloc(nodes, cap * sizeof(*p));
+            if (!p) return NO_NODE;
+            nodes = p;
+            nodes_cap = cap;
+        }
+        n = nnodes++;
+    }
 
-    DIR *d = opendir(root);
-    if (!d) return;
+    memset(&nodes[n], 0, sizeof(nodes[n]));
+    nodes[n].parent = parent;
+    nodes[n].child = nodes[n].prev = nodes[n].next = NO_NODE;
+    if (set_name(n, name, len) < 0 ||
+        (parent == NO_NODE && add_root(n) < 0) ||
+        index_add(&by_name, n) < 0) {
+        if (parent == NO_NODE)
+            drop_root(n);
+        names_dead += nodes[n].name_len;
+        nodes[n].name_len = 0;
+        nodes[n].parent = free_node;
+        free_node = n;
+        return NO_NODE;
+    }
+    if (parent != NO_NODE)
+        link_child(parent, n);
+    return n;
+}
 
-    struct dirent *e;
-    while ((e = readdir(d))) {
-        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+// Frees n and then any ancestors it leaves unwatched and childless.
+static void release(uint32_t n) {
+    while (n != NO_NODE && !nodes[n].wd && !nodes[n].children) {
+        uint32_t parent = nodes[n].parent;
+        index_remove(&by_name, n);
+        if (parent != NO_NODE)
+            unlink_child(n);
+        else
+            drop_root(n);
+        names_dead += nodes[n].name_len;
+        nodes[n].name_len = 0;
+        nodes[n].parent = free_node;
+        free_node = n;
+        n = parent;
+    }
+    compact_names();
+}
+
+// The node for path, created along with any missing ancestors. Paths
+// are taken relative to whichever root is a prefix of them; anything
+// else becomes a root of its own.
+static uint32_t intern(const char *path) {
+    size_t plen = strlen(path);
+    while (plen > 1 && path[plen - 1] == '/')
+        plen--;
+
+    uint32_t n = NO_NODE;
+    size_t at = plen;
+    for (size_t i = 0; i < nroots; i++) {
+        const Node *r = &nodes[roots[i]];
+        if (r->name_len > plen ||
+            memcmp(names + r->name_off, path, r->name_len) ||
+            (r->name_len < plen && path[r->name_len] != '/' &&
+             path[r->name_len - 1] != '/'))
             continue;
+        if (n == NO_NODE || r->name_len > at) {
+            n = roots[i];
+            at = r->name_len;   // the longest root wins
+        }
+    }
+    if (n == NO_NODE)
+        return new_node(NO_NODE, path, plen);
 
-        char sub[PATH_MAX];
-        snprintf(sub, sizeof(sub), "%s/%s", root, e->d_name);
+    while (at < plen) {
+        while (at < plen && path[at] == '/')
+            at++;
+        size_t end = at;
+        while (end < plen && path[end] != '/')
+            end++;
+        if (end == at) break;
 
-        if (lstat(sub, &st) == 0 && S_ISDIR(st.st_mode)) {
-            add_watches_recursive(fd, sub);
+        uint32_t c = find_child(n, path + at, end - at);
+        if (c == NO_NODE && (c = new_node(n, path + at, end - at)) == NO_NODE)
+            return NO_NODE;
+        n = c;
+        at = end;
+    }
+    return n;
+}
+
+static int split_last(const char *path, char *dir, const char **base) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash == path || !slash[1] ||
+        (size_t)(slash - path) >= PATH_MAX)
+        return -1;
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    *base = slash + 1;
+    return 0;
+}
+
+// Hangs node n (and so its whole subtree) under to's parent as to's
+// last component.
+static void reattach(uint32_t n, const char *to) {
+    char dir[PATH_MAX];
+    const char *base;
+    if (split_last(to, dir, &base) < 0)
+        return;
+    uint32_t parent = intern(dir);
+    if (parent == NO_NODE)
+        return;
+    for (uint32_t a = parent; a != NO_NODE; a = nodes[a].parent) {
+        if (a == n) {
+            release(parent);    // not below itself
+            return;
         }
     }
-    closedir(d);
+
+    // Whatever stale node held the new name is dropped from the index.
+    uint32_t stale = find_child(parent, base, strlen(base));
+    if (stale != NO_NODE && stale != n)
+        index_remove(&by_name, stale);
+
+    uint32_t old_parent = nodes[n].parent;
+    index_remove(&by_name, n);
+    if (old_parent == NO_NODE)
+        drop_root(n);
+    else
+        unlink_child(n);
+    nodes[n].parent = parent;
+    link_child(parent, n);
+    if (set_name(n, base, strlen(base)) < 0)
+        set_name(n, "?", 1);
+    index_add(&by_name, n);
+    if (old_parent != NO_NODE)
+        release(old_parent);
 }
 
-void remove_watch_by_wd(int wd) {
-    for (int i = 0; i < watch_count; i++) {
-        if (watches[i].wd == wd) {
-            // Move last element to this position
-            watches[i] = watches[watch_count - 1];
-            watch_count--;
-            break;
+void add_watch(int fd, const char *path) {
+    int wd = inotify_add_watch(fd, path,
+        IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE |
+        IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF);
+
+    if (wd < 0) {
+        if (errno == ENOSPC)
+            fprintf(stderr, "Error: Max watches reached "
+                    "(see /proc/sys/fs/inotify/max_user_watches)\n");
+        return;
+    }
+
+    // Watching a directory again returns its existing wd; if it has
+    // moved, its node follows.
+    uint32_t n = find_wd(wd);
+    if (n != NO_NODE) {
+        const char *cur = get_watch_path(wd);
+        if (!cur || strcmp(cur, path))
+            reattach(n, path);
+        return;
+    }
+    if ((n = intern(path)) == NO_NODE)
+        return;
+    if (nodes[n].wd) {
+        // A directory with a new wd at the same place: the old is gone.
+        index_remove(&by_wd, n);
+        nodes[n].wd = 0;
+    }
+    nodes[n].wd = wd;
+    if (index_add(&by_wd, n) < 0) {
+        nodes[n].wd = 0;
+        release(n);
+    }
+}
+
+static int watch_visit(const WalkEntry *e, WalkEvent ev, void *arg) {
+    if (ev == WALK_ENTER)
+        add_watch(*(int *)arg, e->path);
+    return WALK_CONTINUE;
+}
+
+void add_watches_recursive(int fd, const char *root) {
+    walk_tree(root, watch_visit, &fd);
+}
+
+// Records that the watched directory from is now at to. One node moves;
+// everything below it comes along.
+void move_watch(const char *from, const char *to) {
+    char dir[PATH_MAX];
+    const char *base;
+    if (split_last(from, dir, &base) < 0)
+        return;
+    uint32_t parent = intern(dir);
+    if (parent == NO_NODE)
+        return;
+    uint32_t n = find_child(parent, base, strlen(base));
+    if (n != NO_NODE)
+        reattach(n, to);
+    else
+        release(parent);
+}
+
+// Drops the kernel watches on path and every directory below it, for a
+// tree that has left the source. The registry entries go as each
+// IN_IGNORED arrives.
+void remove_watch_tree(int fd, const char *path) {
+    char dir[PATH_MAX];
+    const char *base;
+    if (split_last(path, dir, &base) < 0)
+        return;
+    uint32_t parent = intern(dir);
+    if (parent == NO_NODE)
+        return;
+    uint32_t top = find_child(parent, base, strlen(base));
+    for (uint32_t n = top; n != NO_NODE; ) {
+        if (nodes[n].wd)
+            inotify_rm_watch(fd, nodes[n].wd);
+        if (nodes[n].child != NO_NODE) {
+            n = nodes[n].child;
+            continue;
         }
+        while (n != top && nodes[n].next == NO_NODE)
+            n = nodes[n].parent;
+        n = n == top ? NO_NODE : nodes[n].next;
     }
+    release(parent);
+}
+
+void remove_watch_by_wd(int wd) {
+    uint32_t n = find_wd(wd);
+    if (n == NO_NODE) return;
+    index_remove(&by_wd, n);
+    nodes[n].wd = 0;
+    release(n);
 }
 
+// Builds the path of a watch into a buffer that stays valid until the
+// next call.
 const char *get_watch_path(int wd) {
-    for (int i = 0; i < watch_count; i++) {
-        if (watches[i].wd == wd) {
-            return watches[i].path;
-        }
+    static char path[PATH_MAX];
+    uint32_t chain[PATH_MAX / 2];
+    size_t depth = 0, len = 0;
+
+    uint32_t n = find_wd(wd);
+    if (n == NO_NODE) return NULL;
+    for (; n != NO_NODE; n = nodes[n].parent) {
+        if (depth == sizeof(chain) / sizeof(chain[0]))
+            return NULL;
+        chain[depth++] = n;
+    }
+
+    while (depth > 0) {
+        const Node *c = &nodes[chain[--depth]];
+        if (len + c->name_len + 2 > sizeof(path))
+            return NULL;
+        if (c->parent != NO_NODE && path[len - 1] != '/')
+            path[len++] = '/';
+        memcpy(path + len, names + c->name_off, c->name_len);
+        len += c->name_len;
     }
-    return NULL;
+    path[len] = '\0';
+    return path;
 }
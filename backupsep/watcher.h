@@ -6,6 +6,8 @@
 
 void add_watch(int fd, const char *path);
 void add_watches_recursive(int fd, const char *root);
+void move_watch(const char *from, const char *to);
+void remove_watch_tree(int fd, const char *path);
 void remove_watch_by_wd(int wd);
 const char *get_watch_path(int wd);
 
@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,81 +6,677 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <limits.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include "worker.h"
-#include "watcher.h"
+#include "events.h"
 #include "utils.h"
+#include "sync.h"
+#include "delta.h"
+#include "append.h"
+#include "filestate.h"
+#include "publish.h"
+#include "manifest.h"
+#include "resync.h"
+#include "session.h"
+#include "coalesce.h"
+#include "intake.h"
+#include "executor.h"
 
-void handle_event(int fd, struct inotify_event *ev,
-                  const char *source, const char *target) {
-
-    char src_path[PATH_MAX], dst_path[PATH_MAX];
-    const char *watch_path = get_watch_path(ev->wd);
-    
-    if (!watch_path) return;
-
-    snprintf(src_path, sizeof(src_path),
-                "%s/%s", watch_path, ev->name);
-    map_path(src_path, source, target, dst_path);
-
-    if (ev->mask & IN_CREATE || ev->mask & IN_MOVED_TO) {
-        struct stat st;
-        lstat(src_path, &st);
-
-        if (S_ISDIR(st.st_mode)) {
-            copy_recursive(src_path, dst_path);
-            add_watches_recursive(fd, src_path);
-        } else if (S_ISREG(st.st_mode)) {
-            copy_recursive(src_path, dst_path);
-        } else if (S_ISLNK(st.st_mode)) {
-            char buf[PATH_MAX];
-            ssize_t len = readlink(src_path, buf, sizeof(buf)-1);
-            if (len >= 0) {
-                buf[len] = 0;
-                symlink(buf, dst_path);
-            }
+// Files that only grew or shrank are extended or truncated in place,
+// large files are patched block by block, and everything else is
+// copied whole.
+static void sync_modified(const char *src, const char *dst,
+                          const BackupOptions *opt) {
+    // In-place updates must see the latest published copy.
+    if (publish_pending(dst))
+        publish_flush();
+
+    if (append_sync(src, dst, NULL) == 0) {
+        publish_dirty(dst);
+        return;
+    }
+
+    struct stat st;
+    if (lstat(src, &st) < 0)
+        return;
+
+    if (opt->delta_min > 0 && S_ISREG(st.st_mode) &&
+        st.st_size >= opt->delta_min && delta_sync(src, dst, NULL) == 0) {
+        publish_dirty(dst);
+        return;
+    }
+
+    filestate_forget(dst, 0);
+    if (!S_ISREG(st.st_mode))
+        copy_recursive(src, dst, NULL);
+    else if (publish_copy(src, dst, NULL, append_track) < 0 &&
+             errno != ENOENT && !copy_cancelled())
+        perror(src);
+}
+
+// How long the IN_MOVED_FROM half of a rename waits for its IN_MOVED_TO.
+// Unpaired, the entry has left the source and is deleted.
+#define MOVE_TIMEOUT_MS 500
+
+typedef struct {
+    uint32_t cookie;
+    int dir;
+    char *src, *dst;
+    struct timespec seen;
+} PendingMove;
+
+typedef struct {
+    EventSource *events;
+    const char *source, *target;
+    const BackupOptions *opt;
+    PendingMove *moves;
+    int nmoves, moves_cap;
+    Resync *resync;
+    WorkerStats *stats;
+    int coalesce;           // file events go through the coalescer
+    Executor *pool;         // applies file jobs in parallel, or NULL
+} Worker;
+
+// What happens to a single file in the target. Jobs run on the executor
+// shard of their target path, so the jobs on one file keep their order
+// while different files are worked on side by side. Work on directories
+// and renames changes where files are, so it waits for every file job
+// before it and runs on the worker itself.
+//
+// Removals and files that fit in one copy chunk go ahead of larger live
+// files, which go ahead of what a resync repairs. Large copies yield to
+// them between chunks.
+
+typedef enum { JOB_CREATE, JOB_UPDATE, JOB_CLOSE, JOB_REMOVE } JobKind;
+
+typedef struct {
+    JobKind kind;
+    const BackupOptions *opt;
+    char *src, *dst;
+} FileJob;
+
+static void remove_now(const char *dst, int dir) {
+    if (dir || publish_pending(dst))
+        publish_flush();
+    filestate_forget(dst, dir);
+    manifest_forget(dst, dir);
+    if (dir)
+        remove_tree(dst);
+    else
+        unlink(dst);
+}
+
+static void create_file(const char *src, const char *dst) {
+    struct stat st;
+    if (lstat(src, &st) < 0)
+        return;
+
+    if (S_ISREG(st.st_mode)) {
+        copy_recursive(src, dst, NULL);
+    } else if (S_ISLNK(st.st_mode)) {
+        char buf[PATH_MAX];
+        ssize_t len = readlink(src, buf, sizeof(buf)-1);
+        if (len >= 0) {
+            buf[len] = 0;
+            symlink(buf, dst);
         }
     }
+}
 
-    if (ev->mask & IN_DELETE || ev->mask & IN_MOVED_FROM) {
-        unlink(dst_path);
+static void do_job(const FileJob *j) {
+    switch (j->kind) {
+    case JOB_CREATE:
+        create_file(j->src, j->dst);
+        break;
+    case JOB_UPDATE:
+        sync_modified(j->src, j->dst, j->opt);
+        break;
+    case JOB_CLOSE:
+        // Closed without writes we saw: only if it differs from its copy.
+        if (!copy_unchanged(j->src, j->dst))
+            sync_modified(j->src, j->dst, j->opt);
+        break;
+    case JOB_REMOVE:
+        remove_now(j->dst, 0);
+        break;
     }
+}
 
-    if (ev->mask & IN_MODIFY) {
-        copy_recursive(src_path, dst_path);
+static void run_job(void *arg) {
+    do_job(arg);
+    free(arg);
+}
+
+static JobPrio job_prio(JobKind kind, const char *src, int bulk) {
+    struct stat st;
+    if (kind == JOB_REMOVE)
+        return PRIO_URGENT;
+    if (bulk)
+        return PRIO_BULK;
+    if (lstat(src, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > COPY_CHUNK)
+        return PRIO_NORMAL;
+    return PRIO_URGENT;
+}
+
+static void file_job(Worker *w, JobKind kind, const char *src,
+                     const char *dst, int bulk) {
+    size_t slen = src ? strlen(src) + 1 : 0, dlen = strlen(dst) + 1;
+    FileJob *j = w->pool ? malloc(sizeof(*j) + slen + dlen) : NULL;
+    if (!j) {
+        FileJob now = {kind, w->opt, (char *)src, (char *)dst};
+        if (w->pool)
+            executor_barrier(w->pool);
+        do_job(&now);
+        return;
     }
+    j->kind = kind;
+    j->opt = w->opt;
+    j->dst = (char *)(j + 1);
+    memcpy(j->dst, dst, dlen);
+    j->src = src ? memcpy(j->dst + dlen, src, slen) : NULL;
+    executor_submit(w->pool, dst, job_prio(kind, src, bulk), run_job, j);
+}
 
-    if (ev->mask & IN_IGNORED) {
-        remove_watch_by_wd(ev->wd);
+// Waits for the file jobs before work that depends on their effects.
+static void settle(Worker *w) {
+    if (w->pool)
+        executor_barrier(w->pool);
+}
+
+static void remove_target(Worker *w, const char *dst, int dir) {
+    session_end(dst);
+    if (dir) {
+        settle(w);
+        remove_now(dst, 1);
+    } else {
+        file_job(w, JOB_REMOVE, NULL, dst, 0);
     }
 }
 
-void run_worker(const char *source, const char *target) {
-    copy_recursive(source, target);
+static void create_target(Worker *w, const char *src, const char *dst,
+                          int bulk) {
+    struct stat st;
+    if (lstat(src, &st) < 0)
+        return;
 
-    int fd = inotify_init1(IN_NONBLOCK);
-    if (fd < 0) exit(1);
+    if (S_ISDIR(st.st_mode)) {
+        // Watched first, as in the initial sync: whatever is written in
+        // it once the copy has passed still comes as events.
+        settle(w);
+        events_watch_tree(w->events, src);
+        copy_recursive(src, dst, NULL);
+    } else {
+        file_job(w, JOB_CREATE, src, dst, bulk);
+    }
+}
 
-    add_watches_recursive(fd, source);
+static void stash_move(Worker *w, const Event *ev, const char *dst) {
+    if (w->nmoves == w->moves_cap) {
+        int cap = w->moves_cap ? w->moves_cap * 2 : 16;
+        PendingMove *m = realloc(w->moves, cap * sizeof(*m));
+        if (!m) {
+            remove_target(w, dst, ev->mask & IN_ISDIR);
+            return;
+        }
+        w->moves = m;
+        w->moves_cap = cap;
+    }
+    PendingMove *m = &w->moves[w->nmoves];
+    m->cookie = ev->cookie;
+    m->dir = (ev->mask & IN_ISDIR) != 0;
+    m->src = strdup(ev->path);
+    m->dst = strdup(dst);
+    if (!m->src || !m->dst) {
+        free(m->src);
+        free(m->dst);
+        remove_target(w, dst, m->dir);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &m->seen);
+    w->nmoves++;
+}
 
-    char buf[4096]
-        __attribute__((aligned(__alignof__(struct inotify_event))));
+static void drop_move(Worker *w, int i) {
+    free(w->moves[i].src);
+    free(w->moves[i].dst);
+    w->moves[i] = w->moves[--w->nmoves];
+}
+
+// Replays a paired rename as one rename in the target, carrying the
+// manifest, the append state and the watches along. Anything that
+// cannot be renamed is copied afresh.
+static void apply_move(Worker *w, const PendingMove *m, const char *src,
+                       const char *dst) {
+    settle(w);
+    if (m->dir || publish_pending(m->dst))
+        publish_flush();
 
-    while (1) {
-        int len = read(fd, buf, sizeof(buf));
-        if (len < 0) {
-            struct timespec ts = {0, 100000000};
-            nanosleep(&ts, NULL);
+    int rc = rename(m->dst, dst);
+    if (rc < 0 && m->dir && (errno == ENOTEMPTY || errno == EEXIST ||
+                             errno == ENOTDIR)) {
+        remove_tree(dst);
+        rc = rename(m->dst, dst);
+    }
+    if (rc < 0) {
+        remove_target(w, m->dst, m->dir);
+        create_target(w, src, dst, 0);
+        return;
+    }
+
+    manifest_move(m->dst, dst, m->dir);
+    filestate_move(m->dst, dst, m->dir);
+    coalesce_move(m->src, src, m->dir);
+    if (m->dir)
+        events_moved(w->events, m->src, src);
+    else
+        session_move(m->dst, dst, src);
+}
+
+// Gives up on pending rename i: what left the source is deleted from
+// the target, along with the watches on it.
+static void give_up_move(Worker *w, int i) {
+    PendingMove *m = &w->moves[i];
+    remove_target(w, m->dst, m->dir);
+    if (m->dir)
+        events_unwatch_tree(w->events, m->src);
+    drop_move(w, i);
+}
+
+// Settles the pending renames an event on path could be mistaken for
+// the second half of, or change the meaning of: those of path, of what
+// is below it and of what it is below. Only the MOVED_TO that pairs with
+// one by cookie leaves it waiting.
+static void resolve_moves(Worker *w, const Event *ev) {
+    for (int i = w->nmoves - 1; i >= 0; i--) {
+        const PendingMove *m = &w->moves[i];
+        if ((ev->mask & IN_MOVED_TO) && ev->cookie &&
+            m->cookie == ev->cookie)
             continue;
+        if (is_subpath(m->src, ev->path) || is_subpath(ev->path, m->src))
+            give_up_move(w, i);
+    }
+}
+
+// Deletes what was moved out of the source and never came back.
+// Returns the ms until the next pending rename gives up, or -1.
+static long long expire_moves(Worker *w) {
+    struct timespec now;
+    long long due = -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = w->nmoves - 1; i >= 0; i--) {
+        PendingMove *m = &w->moves[i];
+        long long ms = (now.tv_sec - m->seen.tv_sec) * 1000LL +
+                       (now.tv_nsec - m->seen.tv_nsec) / 1000000;
+        if (ms < MOVE_TIMEOUT_MS) {
+            if (due < 0 || MOVE_TIMEOUT_MS - ms < due)
+                due = MOVE_TIMEOUT_MS - ms;
+            continue;
+        }
+        // Something new there whose events have not come yet (a
+        // resync may have watched it already) is copied afresh.
+        remove_target(w, m->dst, m->dir);
+        if (m->dir)
+            events_unwatch_tree(w->events, m->src);
+        if (access(m->src, F_OK) == 0)
+            create_target(w, m->src, m->dst, 0);
+        drop_move(w, i);
+    }
+    return due;
+}
+
+// Whether dst has nowhere to go. fanotify resolves an event's directory
+// when it is read, so an event queued before its directory was renamed
+// can name a place the target does not have yet.
+static int parent_missing(const char *dst) {
+    char dir[PATH_MAX];
+    struct stat st;
+    const char *slash = strrchr(dst, '/');
+    if (!slash || slash == dst || (size_t)(slash - dst) >= sizeof(dir))
+        return 0;
+    memcpy(dir, dst, slash - dst);
+    dir[slash - dst] = '\0';
+    return lstat(dir, &st) < 0 || !S_ISDIR(st.st_mode);
+}
+
+static void resync_create(const char *src, const char *dst, void *arg) {
+    create_target(arg, src, dst, 1);
+}
+
+static void resync_remove(const char *dst, int dir, void *arg) {
+    remove_target(arg, dst, dir);
+}
+
+static void resync_update(const char *src, const char *dst, void *arg) {
+    file_job(arg, JOB_UPDATE, src, dst, 1);
+}
+
+// Files held open too long are live changes, not repairs.
+static void session_update(const char *src, const char *dst, void *arg) {
+    file_job(arg, JOB_UPDATE, src, dst, 0);
+}
+
+static void resync_watch(const char *dir, void *arg) {
+    const Worker *w = arg;
+    events_watch_dir(w->events, dir);
+}
+
+// Brings the target in line with one event, or with the net effect of
+// several merged by the coalescer.
+static void apply_event(Worker *w, const Event *ev, const char *dst_path) {
+    const BackupOptions *opt = w->opt;
+    const char *src_path = ev->path;
+
+    uint32_t writes = IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE;
+    if ((ev->mask & writes) && parent_missing(dst_path)) {
+        STAT_ADD(w->stats, overflows, 1);
+        if (w->resync)
+            resync_request(w->resync);
+        return;
+    }
+
+    // Renames come as two events sharing a cookie. The first half waits
+    // for the second; either half alone is a delete or a create.
+    if ((ev->mask & IN_MOVED_FROM) && ev->cookie) {
+        stash_move(w, ev, dst_path);
+        return;
+    }
+    if ((ev->mask & IN_MOVED_TO) && ev->cookie) {
+        for (int i = 0; i < w->nmoves; i++) {
+            if (w->moves[i].cookie == ev->cookie) {
+                apply_move(w, &w->moves[i], src_path, dst_path);
+                drop_move(w, i);
+                return;
+            }
         }
+    }
+
+    // Files are replicated once their writer closes them, or once they
+    // have been written to for stale_ms while held open. A file that is
+    // being created is left to that, rather than copied half written.
+    struct stat st;
+    if ((ev->mask & IN_CREATE) && opt->stale_ms > 0 &&
+        lstat(src_path, &st) == 0 && S_ISREG(st.st_mode))
+        session_dirty(src_path, dst_path);
+    else if (ev->mask & IN_CREATE || ev->mask & IN_MOVED_TO)
+        create_target(w, src_path, dst_path, 0);
+
+    if (ev->mask & IN_DELETE || ev->mask & IN_MOVED_FROM)
+        remove_target(w, dst_path, ev->mask & IN_ISDIR);
+
+    if (ev->mask & IN_MODIFY) {
+        if (opt->stale_ms > 0)
+            session_dirty(src_path, dst_path);
+        else
+            file_job(w, JOB_UPDATE, src_path, dst_path, 0);
+    }
+
+    // Writes seen or not, a close after writing that left the file
+    // different from its copy still needs replicating.
+    if (ev->mask & IN_CLOSE_WRITE)
+        file_job(w, session_end(dst_path) ? JOB_UPDATE : JOB_CLOSE,
+                 src_path, dst_path, 0);
+}
+
+// Where an event on src lands in the target, or -1 if it is not ours to
+// replicate: the source root itself, or the target's metadata directory.
+static int target_path(const Worker *w, const char *src, char *dst) {
+    char meta[PATH_MAX];
+    if (!is_subpath(w->source, src) || !strcmp(w->source, src))
+        return -1;
+    map_path(src, w->source, w->target, dst);
+    snprintf(meta, sizeof(meta), "%s/%s", w->target, META_DIR);
+    return is_subpath(meta, dst) ? -1 : 0;
+}
+
+static void apply_coalesced(const char *path, uint32_t mask, void *arg) {
+    Worker *w = arg;
+    char dst_path[PATH_MAX];
+    Event ev = {mask, 0, -1, path};
+    if (target_path(w, path, dst_path) == 0)
+        apply_event(w, &ev, dst_path);
+}
+
+// Events on files wait in the coalescer; renames, directories and lost
+// events change where later events land, so they are applied at once.
+#define COALESCED (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE)
+
+static void handle_event(const Event *ev, void *arg) {
+    Worker *w = arg;
+
+    STAT_ADD(w->stats, events, 1);
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were dropped; find out what they would have said.
+        STAT_ADD(w->stats, overflows, 1);
+        if (w->resync)
+            resync_request(w->resync);
+        return;
+    }
+
+    char dst_path[PATH_MAX];
+    if (target_path(w, ev->path, dst_path) < 0)
+        return;
+    resolve_moves(w, ev);
+
+    if (w->coalesce && !(ev->mask & ~COALESCED)) {
+        if (coalesce_add(ev->path, ev->mask))
+            STAT_ADD(w->stats, coalesced, 1);
+        return;
+    }
+    if (w->coalesce && !(ev->mask & (IN_MOVED_FROM | IN_MOVED_TO)))
+        coalesce_settle(ev->path, apply_coalesced, w);
+    apply_event(w, ev, dst_path);
+}
+
+// The worker sleeps in epoll_wait until the intake thread has events for
+// it, SIGTERM arrives on a signalfd, or the housekeeping timer fires. The
+// timer is set for the earliest deadline pending (a batch commit, an
+// unpaired rename, a file held open past stale_ms) and disarmed when
+// there is none, so an idle worker does not wake at all.
 
-        for (char *ptr = buf; ptr < buf + len; ) {
-            struct inotify_event *ev = (struct inotify_event *)ptr;
-            handle_event(fd, ev, source, target);
-            ptr += sizeof(struct inotify_event) + ev->len;
+#define MAX_BATCHES 16  // event batches per wakeup before housekeeping
+#define SHUTDOWN_GRACE_MS 2000  // to replicate what is held back on exit
+
+static long long sooner(long long a, long long b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return a < b ? a : b;
+}
+
+static long long housekeeping(Worker *w) {
+    long long due = coalesce_run(apply_coalesced, w);
+    due = sooner(due, publish_tick());
+    due = sooner(due, expire_moves(w));
+    return sooner(due, session_expire(w->opt->stale_ms, session_update, w));
+}
+
+static void arm_timer(int tfd, long long ms) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (ms >= 0) {
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000;
+        if (ms == 0)
+            its.it_value.tv_nsec = 1;   // all zero would disarm
+    }
+    timerfd_settime(tfd, 0, &its, NULL);
+}
+
+static int watch_fd(int ep, int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Cancels the copies in progress once either fd turns readable, while
+// the main loop is busy elsewhere and cannot see it. Nothing is read
+// from them; an fd of -1 is not watched.
+typedef struct {
+    int fd, fd2, quit;
+    pthread_t thread;
+} Guard;
+
+static void *guard_main(void *arg) {
+    Guard *g = arg;
+    struct pollfd p[3] = {{g->fd, POLLIN, 0}, {g->fd2, POLLIN, 0},
+                          {g->quit, POLLIN, 0}};
+    while (poll(p, 3, -1) < 0 && errno == EINTR)
+        ;
+    if ((p[0].revents | p[1].revents) & POLLIN)
+        copy_cancel();
+    return NULL;
+}
+
+static void guard_start(Guard *g, int fd, int fd2) {
+    g->fd = fd;
+    g->fd2 = fd2;
+    g->quit = eventfd(0, EFD_CLOEXEC);
+    if (g->quit >= 0 && pthread_create(&g->thread, NULL, guard_main, g) == 0)
+        return;
+    perror("worker");
+    if (g->quit >= 0) close(g->quit);
+    g->quit = -1;
+}
+
+static void guard_stop(Guard *g) {
+    if (g->quit < 0) return;
+    uint64_t one = 1;
+    if (write(g->quit, &one, sizeof(one)) < 0)
+        perror("worker");
+    pthread_join(g->thread, NULL);
+    close(g->quit);
+}
+
+// With resume, target holds an earlier backup of source.
+void run_worker(const char *source, const char *target,
+                const BackupOptions *opt, int resume, WorkerStats *stats) {
+    // SIGTERM is only ever read from the signalfd. Blocked before any
+    // thread starts, so none of them can be killed by it mid-copy; a
+    // Guard watches the signalfd while the main loop cannot.
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigprocmask(SIG_BLOCK, &sigs, NULL);
+    int sfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (sfd < 0 || tfd < 0 || ep < 0) {
+        perror("worker");
+        exit(1);
+    }
+
+    publish_init(target, opt);
+    copy_set_xattrs(opt->xattrs);
+    if (manifest_open(target, opt->hash, opt->fused) < 0)
+        fprintf(stderr, "No manifest for %s, continuing without\n", target);
+
+    EventSource *events = events_open(source, opt->backend);
+    if (!events) exit(1);
+    Worker w = {events, source, target, opt, NULL, 0, 0, NULL, stats,
+                opt->quiet_ms > 0 || opt->interval_ms > 0, NULL};
+    coalesce_init(opt->quiet_ms, opt->interval_ms);
+    if (!(w.pool = executor_start(opt->executors)))
+        fprintf(stderr, "No executor pool, applying serially\n");
+    copy_set_yield(executor_yield);
+    ResyncOps ops = {resync_create, resync_remove, resync_update,
+                     resync_watch, &w};
+    w.resync = resync_new(source, target, &ops, stats);
+
+    // Watch before copying: changes made during the initial sync queue
+    // up in the kernel and are replayed against the finished target.
+    events_watch_tree(events, source);
+    if (w.resync)
+        resync_baseline(w.resync);
+    Intake *intake = intake_start(events, (size_t)opt->event_buf,
+                                  (size_t)opt->backlog, stats);
+    if (!intake) exit(1);
+    int ifd = intake_fd(intake);
+    if (watch_fd(ep, ifd) < 0 || watch_fd(ep, sfd) < 0 ||
+        watch_fd(ep, tfd) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    // A SIGTERM during the initial sync cancels it rather than waiting.
+    Guard guard;
+    guard_start(&guard, sfd, -1);
+    CopyResult res = {0, COPY_NONE};
+    parallel_sync(source, target, opt, &res);
+    guard_stop(&guard);
+    publish_flush();
+
+    int resyncing = 0, backlog = 0, stop = copy_cancelled();
+    if (stop) {
+        printf("Initial sync interrupted after %lld bytes\n", res.bytes);
+    } else {
+        if (resume)
+            prune_target(target, source);
+        // The commit or the prune touched them.
+        if (opt->sync == SYNC_BATCH || resume)
+            copy_dir_metadata_tree(source, target);
+        printf("Initial sync: %lld bytes copied (%s), watching with %s\n",
+               res.bytes, copy_method_name(res.method),
+               events_backend_name(events));
+        manifest_start_hasher();
+    }
+    fflush(stdout);
+
+    while (!stop) {
+        // A running resync, or events left over from the last wakeup,
+        // only yield to new events; they do not wait.
+        struct epoll_event ready[3];
+        int n = epoll_wait(ep, ready, 3, resyncing || backlog ? 0 : -1);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
         }
+        for (int i = 0; i < n; i++) {
+            int fd = ready[i].data.fd;
+            if (fd == tfd) {
+                uint64_t ticks;
+                read(tfd, &ticks, sizeof(ticks));
+            } else if (fd == sfd) {
+                struct signalfd_siginfo si;
+                if (read(sfd, &si, sizeof(si)) == sizeof(si))
+                    stop = 1;
+            }
+        }
+        backlog = intake_drain(intake, MAX_BATCHES, handle_event, &w);
+        arm_timer(tfd, housekeeping(&w));
+        resyncing = w.resync && resync_step(w.resync);
     }
+
+    // What is still held back is replicated on the way out, but only for
+    // SHUTDOWN_GRACE_MS or until another SIGTERM: the copies running
+    // then are cancelled and the rest fail at once. The manifest does
+    // not vouch for them, so a resume copies them again.
+    arm_timer(tfd, SHUTDOWN_GRACE_MS);
+    guard_start(&guard, sfd, tfd);
+    while (intake_drain(intake, MAX_BATCHES, handle_event, &w))
+        ;
+    intake_stop(intake);
+    coalesce_flush(apply_coalesced, &w);
+    session_expire(0, session_update, &w);
+    executor_stop(w.pool);
+    guard_stop(&guard);
+    publish_flush();
+    manifest_close();
+    events_close(events);
+    resync_free(w.resync);
+    close(ep);
+    close(tfd);
+    close(sfd);
+    exit(0);
 }
@@ -1,6 +1,10 @@
 #ifndef WORKER_H
 #define WORKER_H
 
-void run_worker(const char *source, const char *target);
+#include "options.h"
+#include "stats.h"
+
+void run_worker(const char *source, const char *target,
+                const BackupOptions *opt, int resume, WorkerStats *stats);
 
 #endif